@@ -1,12 +1,14 @@
 #include "libretro.h"
 #include "risc.h"
 #include "disk.h"
+#include "fb-convert.h"
 #include "pclink.h"
 #include "raw-serial.h"
 #include "sdl-ps2.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 static int clamp(int x, int min, int max) {
 	if (x < min) return min;
@@ -19,6 +21,11 @@ static int clamp(int x, int min, int max) {
 
 static uint16_t FOR = 0x0000, AFT = 0xFFFF;
 
+static const struct retro_variable _variables[] = {
+	{ "oberon_color", "16 color mode (requires modified Display.Mod, restart); disabled|enabled" },
+	{ NULL, NULL },
+};
+
 unsigned retro_api_version(void) {
 	return RETRO_API_VERSION; }
 
@@ -64,6 +71,13 @@ struct k_info {
 static struct k_info _keymap[RETROK_LAST];
 
 static struct retro_framebuffer _framebuffer;
+static bool _color;
+static bool _can_dupe;
+
+/* Pixels for each framebuffer byte, and in colour mode the palette
+ * generation they were made for */
+static struct FB_Table16 _table;
+static uint32_t _palette_generation;
 
 void _keyboard_cb(bool down, unsigned keycode,
                   uint32_t character, uint16_t key_modifiers)
@@ -137,7 +151,9 @@ void _keyboard_cb(bool down, unsigned keycode,
 }
 
 void retro_set_environment(retro_environment_t cb) {
-	_environ_cb = cb; }
+	_environ_cb = cb;
+	cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void *)_variables);
+}
 
 void retro_set_video_refresh(retro_video_refresh_t cb) {
 	_video_cb = cb; }
@@ -185,6 +201,20 @@ bool retro_unserialize(const void *data, size_t size) { return false; }
 void retro_cheat_reset(void) { }
 void retro_cheat_set(unsigned index, bool enabled, const char *code) { }
 
+static void update_palette(void)
+{
+	uint32_t *palette = risc_get_palette_ptr(_risc);
+	uint16_t palette565[16];
+	_palette_generation = risc_get_palette_generation(_risc);
+	for (int i = 0; i < 16; i++) {
+		uint32_t rgb = palette[i];
+		palette565[i] = (uint16_t)(((rgb >> 8) & 0xF800) |
+		                           ((rgb >> 5) & 0x07E0) |
+		                           ((rgb >> 3) & 0x001F));
+	}
+	fb_build_table16(&_table, palette565, 16);
+}
+
 /* Loads a game. */
 bool retro_load_game(const struct retro_game_info *game)
 {
@@ -195,13 +225,14 @@ bool retro_load_game(const struct retro_game_info *game)
 	}
 
 	if (game->path)
-		_spi_disk = disk_new(game->path);
+		_spi_disk = disk_new(game->path, NULL);
 	if (!_spi_disk) {
 		_log_cb(RETRO_LOG_ERROR, "failed to load disk image\n");
 		return false;
 	}
 
 	risc_set_spi(_risc, 1, _spi_disk);
+	risc_set_disk_dma(_risc, disk_get_dma(_spi_disk));
 	risc_set_serial(_risc, raw_serial_new("/dev/null", "/dev/null"));
 
 	enum retro_pixel_format pf = RETRO_PIXEL_FORMAT_RGB565;
@@ -226,7 +257,19 @@ bool retro_load_game(const struct retro_game_info *game)
 		_framebuffer.height *
 		sizeof(uint16_t));
 
-	risc_configure_memory(_risc, 1, _framebuffer.width, _framebuffer.height);
+	struct retro_variable var = { "oberon_color", NULL };
+	_color = _environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var)
+		&& var.value && strcmp(var.value, "enabled") == 0;
+
+	if (!_environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &_can_dupe))
+		_can_dupe = false;
+
+	risc_configure_memory(_risc, 1, false,
+		_framebuffer.width, _framebuffer.height, _color);
+	if (_color)
+		update_palette();
+	else
+		fb_build_table16(&_table, (uint16_t[]){ AFT, FOR }, 2);
 
 	_ms_counter = 1;
 	_mouse_x = 0;
@@ -255,7 +298,7 @@ bool retro_load_game_special(
 void retro_unload_game(void)
 {
 	if (!_risc && _spi_disk) {
-		free(_spi_disk);
+		disk_free(_spi_disk);
 		_spi_disk = NULL;
 	}
 }
@@ -265,6 +308,27 @@ unsigned retro_get_region(void) { return ~0U; }
 void  *retro_get_memory_data(unsigned id) { return NULL; }
 size_t retro_get_memory_size(unsigned id) { return 0; }
 
+static void draw_damage(const struct Damage *damage)
+{
+	uint32_t *in = risc_get_framebuffer_ptr(_risc);
+	uint16_t *out = _framebuffer.data;
+	int pixels_per_word = _color ? 8 : 32;
+	int in_width = _framebuffer.width / pixels_per_word;
+	int words = damage->x2 - damage->x1 + 1;
+
+	for (int line = damage->y2; line >= damage->y1; line--) {
+		int in_line = line * in_width;
+
+		int out_idx = ((_framebuffer.height-line-1) * _framebuffer.width)
+		            + damage->x1 * pixels_per_word;
+
+		if (_color)
+			fb_color_to_rgb565(&out[out_idx], &in[in_line + damage->x1], words, &_table);
+		else
+			fb_mono_to_rgb565(&out[out_idx], &in[in_line + damage->x1], words, &_table);
+	}
+}
+
 void retro_run(void)
 {
 	_input_poll_cb();
@@ -289,32 +353,32 @@ void retro_run(void)
 	_ms_counter += 1000 / FPS;
 	risc_run(_risc, CPU_HZ / FPS);
 
- 	struct Damage damage = risc_get_framebuffer_damage(_risc);
-	if (damage.y1 <= damage.y2) {
-
-		uint32_t *in = risc_get_framebuffer_ptr(_risc);
-		uint16_t *out = _framebuffer.data;
-		uint16_t colors[] = { AFT, FOR };
-
-		for (int line = damage.y2; line >= damage.y1; line--) {
-			int in_line = line * (_framebuffer.width / 32);
-
-			int out_idx = ((_framebuffer.height-line-1) * _framebuffer.width)
-			            + damage.x1 * 32;
-
-			for (int col = damage.x1; col <= damage.x2; col++) {
-				uint32_t chunk = in[in_line + col];
-				for (int b = 0; b < 32; b++) {
-					out[out_idx] = colors[chunk&1];
-					chunk >>= 1;
-					out_idx++;
-				}
-			}
-		}
+	/* A new palette damages nothing but needs everything redrawn, once
+	 * a frame however many entries changed */
+	bool redraw = _color && risc_get_palette_generation(_risc) != _palette_generation;
+	if (redraw)
+		update_palette();
+
+	bool changed = redraw;
+	struct Damage damage;
+	while (risc_get_framebuffer_damage(_risc, &damage)) {
+		changed = true;
+		if (!redraw)
+			draw_damage(&damage);
+	}
+	if (redraw) {
+		damage = (struct Damage){
+			.x1 = 0,
+			.x2 = _framebuffer.width / (_color ? 8 : 32) - 1,
+			.y1 = 0,
+			.y2 = _framebuffer.height - 1
+		};
+		draw_damage(&damage);
 	}
 
+	/* Let the frontend show the previous frame again if nothing changed */
 	_video_cb(
-		_framebuffer.data,
+		changed || !_can_dupe ? _framebuffer.data : NULL,
 		_framebuffer.width,
 		_framebuffer.height,
 		_framebuffer.width << 1);
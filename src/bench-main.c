@@ -0,0 +1,466 @@
+// A headless benchmark driver: boots a disk image without SDL or VNC,
+// plays a script of keyboard and mouse input, runs as fast as the host
+// allows and reports how fast that was.
+//
+// Guest time is derived from the instruction count (CPU_HZ / 1000
+// instructions per millisecond), and idle stretches are skipped, so a
+// run doesn't depend on the speed of the host and repeats exactly.
+
+#define _POSIX_C_SOURCE 200809L
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "risc.h"
+#include "risc-io.h"
+#include "disk.h"
+
+#define CPU_HZ 25000000
+#define MAX_SCRIPT_LINE 256
+
+// Compiles the compiler, on the standard disk image at the standard
+// screen size: click into the System.Log viewer, type the command there
+// and middle-click it.
+static const char *default_script =
+  "idle\n"
+  "move 700 590\n"
+  "click 1\n"
+  "type \\nORP.Compile ORS.Mod ORB.Mod ORG.Mod ORP.Mod ~\n"
+  "move 665 581\n"
+  "click 2\n";
+
+static struct option long_options[] = {
+  { "jit",              no_argument,       NULL, 'J' },
+  { "mem",              required_argument, NULL, 'm' },
+  { "script",           required_argument, NULL, 'x' },
+  { "until-serial",     required_argument, NULL, 'u' },
+  { "until-leds",       required_argument, NULL, 'l' },
+  { "limit",            required_argument, NULL, 't' },
+  { "profile",          required_argument, NULL, 'P' },
+  { "mmap-disk",        no_argument,       NULL, 'D' },
+  { "disk-cache",       required_argument, NULL, 'C' },
+  { NULL,               no_argument,       NULL, 0   }
+};
+
+static void fail(int code, const char *fmt, ...);
+
+static void usage() {
+  puts("Usage: risc-bench [OPTIONS...] DISK-IMAGE\n"
+       "\n"
+       "Options:\n"
+       "  --jit                 Translate RISC code to native code (x86-64 only)\n"
+       "  --mem MEGS            Set memory size\n"
+       "  --script FILE         Play the input script in FILE instead of compiling\n"
+       "                        the compiler\n"
+       "  --until-serial TEXT   After the script, run until TEXT is written to the\n"
+       "                        serial port\n"
+       "  --until-leds VALUE    After the script, run until VALUE is written to the LEDs\n"
+       "  --limit MS            Give up after MS milliseconds of guest time\n"
+       "                        (default 600000)\n"
+       "  --profile FILE        Write a guest profile with call stacks to FILE\n"
+       "  --mmap-disk           Map the disk image into memory instead of using stdio\n"
+       "  --disk-cache SECTORS  Cache SECTORS disk sectors and write back in the background\n"
+       "\n"
+       "Script commands, one per line (# starts a comment):\n"
+       "  idle                  Run until the guest waits for input\n"
+       "  wait MS               Run for MS milliseconds of guest time\n"
+       "  move X Y              Move the mouse (origin at the top left)\n"
+       "  press N, release N    Press or release mouse button N (1-3)\n"
+       "  click N               Press and release mouse button N\n"
+       "  type TEXT             Type TEXT (\\n is Return, \\t is Tab)\n"
+       "Every input command also runs until the guest is idle again.\n"
+       );
+  exit(1);
+}
+
+static void fail(int code, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  exit(code);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+// Devices that count the time spent in them.
+
+struct Timed {
+  double seconds;
+  uint64_t calls;
+};
+
+static struct Timed disk_time, serial_time;
+
+struct TimedSPI {
+  struct RISC_SPI spi;
+  const struct RISC_SPI *inner;
+};
+
+static uint32_t timed_spi_read(const struct RISC_SPI *spi) {
+  const struct TimedSPI *t = (const struct TimedSPI *)spi;
+  double start = now();
+  uint32_t value = t->inner->read_data(t->inner);
+  disk_time.seconds += now() - start;
+  disk_time.calls++;
+  return value;
+}
+
+static void timed_spi_write(const struct RISC_SPI *spi, uint32_t value, bool fast) {
+  const struct TimedSPI *t = (const struct TimedSPI *)spi;
+  double start = now();
+  t->inner->write_data(t->inner, value, fast);
+  disk_time.seconds += now() - start;
+  disk_time.calls++;
+}
+
+struct TimedDMA {
+  struct RISC_DiskDMA dma;
+  const struct RISC_DiskDMA *inner;
+};
+
+static bool timed_dma_read(const struct RISC_DiskDMA *dma, uint32_t block, uint32_t count, uint32_t *dst) {
+  const struct TimedDMA *t = (const struct TimedDMA *)dma;
+  double start = now();
+  bool ok = t->inner->read(t->inner, block, count, dst);
+  disk_time.seconds += now() - start;
+  disk_time.calls++;
+  return ok;
+}
+
+static bool timed_dma_write(const struct RISC_DiskDMA *dma, uint32_t block, uint32_t count, const uint32_t *src) {
+  const struct TimedDMA *t = (const struct TimedDMA *)dma;
+  double start = now();
+  bool ok = t->inner->write(t->inner, block, count, src);
+  disk_time.seconds += now() - start;
+  disk_time.calls++;
+  return ok;
+}
+
+// The serial port only collects output, to look for the sentinel.
+static char serial_buf[4096];
+static size_t serial_len;
+static const char *serial_sentinel;
+static bool sentinel_seen;
+
+static uint32_t serial_read_status(const struct RISC_Serial *serial) {
+  return 2;  // nothing to read, ready to send
+}
+
+static uint32_t serial_read_data(const struct RISC_Serial *serial) {
+  return 0;
+}
+
+static void serial_write_data(const struct RISC_Serial *serial, uint32_t value) {
+  double start = now();
+  if (serial_len == sizeof(serial_buf) - 1) {
+    // Keep the tail, which is all a sentinel can still match.
+    size_t keep = strlen(serial_sentinel ? serial_sentinel : "");
+    memmove(serial_buf, serial_buf + serial_len - keep, keep);
+    serial_len = keep;
+  }
+  serial_buf[serial_len++] = (char)value;
+  serial_buf[serial_len] = 0;
+  if (serial_sentinel && strstr(serial_buf, serial_sentinel)) {
+    sentinel_seen = true;
+  }
+  serial_time.seconds += now() - start;
+  serial_time.calls++;
+}
+
+static const struct RISC_Serial bench_serial = {
+  .read_status = serial_read_status,
+  .read_data = serial_read_data,
+  .write_data = serial_write_data
+};
+
+static bool leds_sentinel_set;
+static uint32_t leds_sentinel;
+
+static void leds_write(const struct RISC_LED *leds, uint32_t value) {
+  if (leds_sentinel_set && value == leds_sentinel) {
+    sentinel_seen = true;
+  }
+}
+
+static const struct RISC_LED bench_leds = {
+  .write = leds_write
+};
+
+
+// Running the machine.
+
+static struct RISC *risc;
+static uint32_t guest_ms, limit_ms = 600000;
+static uint64_t instructions;
+static double run_seconds;
+
+// Runs one millisecond of guest time, or less if the guest goes idle,
+// in which case the rest of the millisecond is skipped. Returns true if
+// the guest went idle.
+static bool run_slice(void) {
+  if (guest_ms >= limit_ms) {
+    fail(2, "Guest time limit of %u ms reached", limit_ms);
+  }
+  risc_set_time(risc, guest_ms++);
+  double start = now();
+  instructions += risc_run(risc, CPU_HZ / 1000);
+  run_seconds += now() - start;
+  return risc_is_idle(risc);
+}
+
+static void run_until_idle(void) {
+  while (!run_slice()) {
+  }
+}
+
+// Scancodes of the keys on a US keyboard, with and without Shift.
+static const char plain_keys[] = "`1234567890-=qwertyuiop[]\\asdfghjkl;'zxcvbnm,./";
+static const char shift_keys[] = "~!@#$%^&*()_+QWERTYUIOP{}|ASDFGHJKL:\"ZXCVBNM<>?";
+static const uint8_t key_codes[] = {
+  0x0E, 0x16, 0x1E, 0x26, 0x25, 0x2E, 0x36, 0x3D, 0x3E, 0x46, 0x45, 0x4E, 0x55,
+  0x15, 0x1D, 0x24, 0x2D, 0x2C, 0x35, 0x3C, 0x43, 0x44, 0x4D, 0x54, 0x5B, 0x5D,
+  0x1C, 0x1B, 0x23, 0x2B, 0x34, 0x33, 0x3B, 0x42, 0x4B, 0x4C, 0x52,
+  0x1A, 0x22, 0x21, 0x2A, 0x32, 0x31, 0x3A, 0x41, 0x49, 0x4A
+};
+
+static void type_char(char ch) {
+  uint8_t code;
+  bool shift = false;
+  const char *p;
+  if (ch == '\n') {
+    code = 0x5A;
+  } else if (ch == '\t') {
+    code = 0x0D;
+  } else if (ch == ' ') {
+    code = 0x29;
+  } else if (ch != 0 && (p = strchr(plain_keys, ch)) != NULL) {
+    code = key_codes[p - plain_keys];
+  } else if (ch != 0 && (p = strchr(shift_keys, ch)) != NULL) {
+    code = key_codes[p - shift_keys];
+    shift = true;
+  } else {
+    fail(1, "Can't type character 0x%02X", (unsigned char)ch);
+  }
+
+  uint8_t buf[6];
+  uint32_t len = 0;
+  if (shift) {
+    buf[len++] = 0x12;
+  }
+  buf[len++] = code;
+  buf[len++] = 0xF0;
+  buf[len++] = code;
+  if (shift) {
+    buf[len++] = 0xF0;
+    buf[len++] = 0x12;
+  }
+  risc_keyboard_input(risc, buf, len);
+  run_until_idle();
+}
+
+static void run_script_line(char *line, int lineno, int height) {
+  char *cmd = line + strspn(line, " \t");
+  char *arg = cmd + strcspn(cmd, " \t\n");
+  if (*arg) {
+    *arg++ = 0;
+  }
+  arg[strcspn(arg, "\n")] = 0;
+
+  int x, y, n;
+  if (*cmd == 0 || *cmd == '#') {
+    return;
+  } else if (strcmp(cmd, "idle") == 0) {
+    run_until_idle();
+  } else if (strcmp(cmd, "wait") == 0 && sscanf(arg, "%d", &n) == 1) {
+    for (uint32_t end = guest_ms + n; guest_ms < end; ) {
+      run_slice();
+    }
+  } else if (strcmp(cmd, "move") == 0 && sscanf(arg, "%d %d", &x, &y) == 2) {
+    risc_mouse_moved(risc, x, height - y - 1);
+    run_until_idle();
+  } else if (strcmp(cmd, "press") == 0 && sscanf(arg, "%d", &n) == 1) {
+    risc_mouse_button(risc, n, true);
+    run_until_idle();
+  } else if (strcmp(cmd, "release") == 0 && sscanf(arg, "%d", &n) == 1) {
+    risc_mouse_button(risc, n, false);
+    run_until_idle();
+  } else if (strcmp(cmd, "click") == 0 && sscanf(arg, "%d", &n) == 1) {
+    risc_mouse_button(risc, n, true);
+    run_until_idle();
+    risc_mouse_button(risc, n, false);
+    run_until_idle();
+  } else if (strcmp(cmd, "type") == 0) {
+    for (char *p = arg; *p; p++) {
+      if (p[0] == '\\' && p[1] == 'n') {
+        type_char('\n');
+        p++;
+      } else if (p[0] == '\\' && p[1] == 't') {
+        type_char('\t');
+        p++;
+      } else if (p[0] == '\\' && p[1] == '\\') {
+        type_char('\\');
+        p++;
+      } else {
+        type_char(*p);
+      }
+    }
+  } else {
+    fail(1, "Script line %d: can't make sense of '%s'", lineno, cmd);
+  }
+}
+
+static void run_script(const char *filename, int height) {
+  char line[MAX_SCRIPT_LINE];
+  int lineno = 0;
+  if (filename) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+      fail(1, "Can't open script %s", filename);
+    }
+    while (fgets(line, sizeof(line), f)) {
+      run_script_line(line, ++lineno, height);
+    }
+    fclose(f);
+  } else {
+    for (const char *p = default_script; *p; ) {
+      size_t len = strcspn(p, "\n");
+      memcpy(line, p, len);
+      line[len] = 0;
+      run_script_line(line, ++lineno, height);
+      p += len + (p[len] == '\n');
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  risc = risc_new();
+
+  bool jit_option = false;
+  int mem_option = 0;
+  const char *script = NULL;
+  const char *profile_file = NULL;
+  struct DiskOptions disk_options = { 0 };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "Jm:x:u:l:t:P:DC:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'J': {
+        jit_option = true;
+        break;
+      }
+      case 'm': {
+        if (sscanf(optarg, "%d", &mem_option) != 1) {
+          usage();
+        }
+        break;
+      }
+      case 'x': {
+        script = optarg;
+        break;
+      }
+      case 'u': {
+        serial_sentinel = optarg;
+        break;
+      }
+      case 'l': {
+        int value;
+        if (sscanf(optarg, "%i", &value) != 1) {
+          usage();
+        }
+        leds_sentinel = value;
+        leds_sentinel_set = true;
+        break;
+      }
+      case 't': {
+        int value;
+        if (sscanf(optarg, "%d", &value) != 1 || value < 1) {
+          usage();
+        }
+        limit_ms = value;
+        break;
+      }
+      case 'P': {
+        profile_file = optarg;
+        break;
+      }
+      case 'D': {
+        disk_options.mmap = true;
+        break;
+      }
+      case 'C': {
+        if (sscanf(optarg, "%d", &disk_options.cache_sectors) != 1 || disk_options.cache_sectors < 1) {
+          usage();
+        }
+        break;
+      }
+      default: {
+        usage();
+      }
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+  }
+
+  if (mem_option) {
+    risc_configure_memory(risc, mem_option, false, RISC_FRAMEBUFFER_WIDTH, RISC_FRAMEBUFFER_HEIGHT, false);
+  }
+  if (jit_option && !risc_enable_jit(risc)) {
+    jit_option = false;
+  }
+  if (profile_file) {
+    risc_enable_profiler(risc, 10000, true);
+  }
+
+  struct TimedSPI disk = {
+    .spi = { .read_data = timed_spi_read, .write_data = timed_spi_write },
+    .inner = disk_new(argv[optind], &disk_options)
+  };
+  struct TimedDMA disk_dma = {
+    .dma = { .read = timed_dma_read, .write = timed_dma_write },
+    .inner = disk_get_dma(disk.inner)
+  };
+  risc_set_spi(risc, 1, &disk.spi);
+  risc_set_disk_dma(risc, &disk_dma.dma);
+  risc_set_serial(risc, &bench_serial);
+  risc_set_leds(risc, &bench_leds);
+
+  double start = now();
+  run_script(script, RISC_FRAMEBUFFER_HEIGHT);
+  if (serial_sentinel || leds_sentinel_set) {
+    while (!sentinel_seen) {
+      run_slice();
+    }
+  }
+  double wall = now() - start;
+  disk_free(disk.inner);
+
+  if (profile_file && !risc_write_profile(risc, profile_file)) {
+    fprintf(stderr, "Could not write profile to %s\n", profile_file);
+  }
+
+  double cpu = run_seconds - disk_time.seconds - serial_time.seconds;
+  printf("core          %s\n", jit_option ? "jit" : "interpreter");
+  printf("instructions  %llu\n", (unsigned long long)instructions);
+  printf("guest time    %.3f s\n", guest_ms / 1000.0);
+  printf("wall time     %.3f s\n", wall);
+  printf("MIPS          %.1f\n", (double)instructions / wall / 1e6);
+  printf("cpu           %.3f s\n", cpu);
+  printf("disk          %.3f s  (%llu SPI transfers)\n",
+         disk_time.seconds, (unsigned long long)disk_time.calls);
+  printf("serial        %.3f s  (%llu bytes)\n",
+         serial_time.seconds, (unsigned long long)serial_time.calls);
+  printf("other         %.3f s\n", wall - run_seconds);
+  return 0;
+}
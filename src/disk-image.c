@@ -0,0 +1,1031 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "disk-image.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/mman.h>
+#define DISK_MMAP 1
+#define DISK_CACHE 1
+#else
+#include <io.h>
+#define DISK_MMAP 0
+#define DISK_CACHE 0
+#define fdatasync _commit
+#endif
+
+// macOS has no fdatasync; fsync also writes the metadata back.
+#ifdef __APPLE__
+#define fdatasync fsync
+#endif
+
+// Images are stored little-endian, so on such hosts a sector's words
+// are its bytes as they are.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DISK_LITTLE_ENDIAN 1
+#elif defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define DISK_LITTLE_ENDIAN 1
+#else
+#define DISK_LITTLE_ENDIAN 0
+#endif
+
+// Mappings grow in steps of at least this much.
+#define MAP_GRANULE (1u << 20)
+
+// Changed sectors wait this long in the cache for their neighbours
+// before they are written back.
+#define CACHE_DELAY_MS 50
+
+// After a failed write-back, sectors stay dirty and are retried this
+// much later, or sooner if a sync asks for it.
+#define CACHE_RETRY_MS 1000
+
+// An overlay file starts with a header of COW_HEADER bytes:
+//   magic (8 bytes), size of the base image in bytes (8), size of the
+//   image in sectors (4), sectors of the base still in the image (4)
+// followed by records of a sector number (4) and the sector's bytes.
+// A record that was dropped by a trim has COW_FREE as sector number.
+#define COW_MAGIC  "RISC-COW"
+#define COW_HEADER 512
+#define COW_RECORD (4 + SECTOR_SIZE)
+#define COW_FREE   0xFFFFFFFFu
+
+static uint32_t load_le(const uint8_t *bytes) {
+  return (uint32_t)bytes[0]
+    | ((uint32_t)bytes[1] << 8)
+    | ((uint32_t)bytes[2] << 16)
+    | ((uint32_t)bytes[3] << 24);
+}
+
+static void store_le(uint8_t *bytes, uint32_t value) {
+  bytes[0] = (uint8_t)value;
+  bytes[1] = (uint8_t)(value >> 8);
+  bytes[2] = (uint8_t)(value >> 16);
+  bytes[3] = (uint8_t)(value >> 24);
+}
+
+static void bytes_to_words(uint32_t *words, const uint8_t *bytes) {
+#if DISK_LITTLE_ENDIAN
+  memcpy(words, bytes, SECTOR_SIZE);
+#else
+  for (int i = 0; i < SECTOR_SIZE / 4; i++) {
+    words[i] = (uint32_t)bytes[i*4+0]
+      | ((uint32_t)bytes[i*4+1] << 8)
+      | ((uint32_t)bytes[i*4+2] << 16)
+      | ((uint32_t)bytes[i*4+3] << 24);
+  }
+#endif
+}
+
+static void words_to_bytes(uint8_t *bytes, const uint32_t *words) {
+#if DISK_LITTLE_ENDIAN
+  memcpy(bytes, words, SECTOR_SIZE);
+#else
+  for (int i = 0; i < SECTOR_SIZE / 4; i++) {
+    bytes[i*4+0] = (uint8_t)(words[i]      );
+    bytes[i*4+1] = (uint8_t)(words[i] >>  8);
+    bytes[i*4+2] = (uint8_t)(words[i] >> 16);
+    bytes[i*4+3] = (uint8_t)(words[i] >> 24);
+  }
+#endif
+}
+
+
+struct FileImage {
+  struct DiskImage image;
+  FILE *file;
+};
+
+static void file_read(struct DiskImage *image, uint32_t sector, uint32_t *buf) {
+  struct FileImage *fi = (struct FileImage *)image;
+  uint8_t bytes[SECTOR_SIZE] = { 0 };
+  if (fseeko(fi->file, (off_t)sector * SECTOR_SIZE, SEEK_SET) == 0) {
+    fread(bytes, SECTOR_SIZE, 1, fi->file);
+  }
+  bytes_to_words(buf, bytes);
+}
+
+static void file_write(struct DiskImage *image, uint32_t sector, const uint32_t *buf) {
+  struct FileImage *fi = (struct FileImage *)image;
+  uint8_t bytes[SECTOR_SIZE];
+  words_to_bytes(bytes, buf);
+  if (fseeko(fi->file, (off_t)sector * SECTOR_SIZE, SEEK_SET) == 0) {
+    fwrite(bytes, SECTOR_SIZE, 1, fi->file);
+  }
+}
+
+static void file_sync(struct DiskImage *image) {
+  struct FileImage *fi = (struct FileImage *)image;
+  fflush(fi->file);
+  fdatasync(fileno(fi->file));
+}
+
+static void file_trim(struct DiskImage *image, uint32_t sector) {
+  struct FileImage *fi = (struct FileImage *)image;
+  fflush(fi->file);
+  ftruncate(fileno(fi->file), (off_t)sector * SECTOR_SIZE);
+  fi->file = freopen(NULL, "rb+", fi->file);
+}
+
+static void file_close(struct DiskImage *image) {
+  struct FileImage *fi = (struct FileImage *)image;
+  if (fi->file) {
+    fclose(fi->file);
+  }
+  free(fi);
+}
+
+struct DiskImage *disk_image_open(const char *filename) {
+  FILE *file = fopen(filename, "rb+");
+  if (!file) {
+    return NULL;
+  }
+  struct FileImage *fi = calloc(1, sizeof(*fi));
+  fi->image = (struct DiskImage) {
+    .read = file_read,
+    .write = file_write,
+    .sync = file_sync,
+    .trim = file_trim,
+    .close = file_close
+  };
+  fi->file = file;
+  return &fi->image;
+}
+
+
+#if DISK_MMAP
+
+struct MappedImage {
+  struct DiskImage image;
+  int fd;
+  uint8_t *map;
+  size_t size;      // of the file
+  size_t capacity;  // of the mapping, which may run past the end of the file
+  int sync_ms;
+  uint64_t last_sync;
+  bool dirty;
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Maps at least size bytes. Pages past the end of the file are never
+// touched, as that would fault; they only leave room to grow.
+static bool map_remap(struct MappedImage *mi, size_t size) {
+  size_t capacity = mi->capacity ? mi->capacity : MAP_GRANULE;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+  if (mi->map && capacity == mi->capacity) {
+    return true;
+  }
+  void *map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, mi->fd, 0);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  if (mi->map) {
+    munmap(mi->map, mi->capacity);
+  }
+  mi->map = map;
+  mi->capacity = capacity;
+  return true;
+}
+
+static void map_write_back(struct MappedImage *mi) {
+  if (mi->dirty) {
+    msync(mi->map, mi->size, MS_SYNC);
+    mi->dirty = false;
+  }
+  mi->last_sync = now_ms();
+}
+
+static void map_read(struct DiskImage *image, uint32_t sector, uint32_t *buf) {
+  struct MappedImage *mi = (struct MappedImage *)image;
+  uint64_t start = (uint64_t)sector * SECTOR_SIZE;
+  if (start + SECTOR_SIZE <= mi->size) {
+    bytes_to_words(buf, mi->map + start);
+  } else {
+    uint8_t bytes[SECTOR_SIZE] = { 0 };
+    if (start < mi->size) {
+      memcpy(bytes, mi->map + start, mi->size - start);
+    }
+    bytes_to_words(buf, bytes);
+  }
+}
+
+static void map_write(struct DiskImage *image, uint32_t sector, const uint32_t *buf) {
+  struct MappedImage *mi = (struct MappedImage *)image;
+  uint64_t end = (uint64_t)sector * SECTOR_SIZE + SECTOR_SIZE;
+  if (end > mi->size) {
+    if (end > SIZE_MAX || ftruncate(mi->fd, (off_t)end) != 0) {
+      return;
+    }
+    mi->size = (size_t)end;
+    if (!map_remap(mi, mi->size)) {
+      fprintf(stderr, "Can't map disk image: %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+  words_to_bytes(mi->map + end - SECTOR_SIZE, buf);
+  mi->dirty = true;
+  if (mi->sync_ms > 0 && now_ms() - mi->last_sync >= (uint64_t)mi->sync_ms) {
+    map_write_back(mi);
+  }
+}
+
+static void map_sync(struct DiskImage *image) {
+  map_write_back((struct MappedImage *)image);
+}
+
+static void map_trim(struct DiskImage *image, uint32_t sector) {
+  struct MappedImage *mi = (struct MappedImage *)image;
+  uint64_t start = (uint64_t)sector * SECTOR_SIZE;
+  if (start < mi->size && ftruncate(mi->fd, (off_t)start) == 0) {
+    mi->size = (size_t)start;
+  }
+}
+
+static void map_close(struct DiskImage *image) {
+  struct MappedImage *mi = (struct MappedImage *)image;
+  map_write_back(mi);
+  munmap(mi->map, mi->capacity);
+  close(mi->fd);
+  free(mi);
+}
+
+struct DiskImage *disk_image_map(const char *filename, int sync_ms) {
+  int fd = open(filename, O_RDWR);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size > SIZE_MAX) {
+    int err = (uint64_t)st.st_size > SIZE_MAX ? EFBIG : errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+  struct MappedImage *mi = calloc(1, sizeof(*mi));
+  mi->image = (struct DiskImage) {
+    .read = map_read,
+    .write = map_write,
+    .sync = map_sync,
+    .trim = map_trim,
+    .close = map_close
+  };
+  mi->fd = fd;
+  mi->size = (size_t)st.st_size;
+  mi->sync_ms = sync_ms;
+  mi->last_sync = now_ms();
+  if (!map_remap(mi, mi->size)) {
+    int err = errno;
+    close(fd);
+    free(mi);
+    errno = err;
+    return NULL;
+  }
+  return &mi->image;
+}
+
+#else  // !DISK_MMAP
+
+struct DiskImage *disk_image_map(const char *filename, int sync_ms) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+#endif  // DISK_MMAP
+
+
+#if DISK_CACHE
+
+struct CacheEntry {
+  uint32_t sector;
+  int prev, next;    // in the LRU list, most recently used first
+  int chain;         // next entry in the same hash bucket
+  bool dirty;        // changed since it was last written back
+  uint32_t version;  // counts writes, to notice them during a write-back
+  uint32_t words[SECTOR_SIZE / 4];
+};
+
+// A sector on its way to the file.
+struct PendingWrite {
+  uint32_t sector;
+  int entry;
+  uint32_t version;
+  bool written;
+};
+
+struct CachedImage {
+  struct DiskImage image;
+  int fd;
+  int sync_ms;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;  // for the flusher: sectors to write, a sync or stop
+  pthread_cond_t done;  // from the flusher: a write-back has finished
+  pthread_t flusher;
+
+  // Everything below is guarded by lock, except that the flusher has
+  // pending and buf to itself.
+  struct CacheEntry *entries;
+  int capacity, count;
+  int *buckets;
+  uint32_t bucket_mask;
+  int head, tail;
+  int dirty;
+  uint64_t syncs_wanted, syncs_done;
+  bool stop;
+
+  struct PendingWrite *pending;
+  uint8_t *buf;
+};
+
+static int cache_lookup(struct CachedImage *ci, uint32_t sector) {
+  int i = ci->buckets[sector & ci->bucket_mask];
+  while (i >= 0 && ci->entries[i].sector != sector) {
+    i = ci->entries[i].chain;
+  }
+  return i;
+}
+
+static void cache_unlink(struct CachedImage *ci, int i) {
+  struct CacheEntry *e = &ci->entries[i];
+  if (e->prev >= 0) {
+    ci->entries[e->prev].next = e->next;
+  } else {
+    ci->head = e->next;
+  }
+  if (e->next >= 0) {
+    ci->entries[e->next].prev = e->prev;
+  } else {
+    ci->tail = e->prev;
+  }
+}
+
+static void cache_touch(struct CachedImage *ci, int i) {
+  if (ci->head == i) {
+    return;
+  }
+  cache_unlink(ci, i);
+  struct CacheEntry *e = &ci->entries[i];
+  e->prev = -1;
+  e->next = ci->head;
+  ci->entries[ci->head].prev = i;
+  ci->head = i;
+}
+
+static void cache_unhash(struct CachedImage *ci, int i) {
+  int *link = &ci->buckets[ci->entries[i].sector & ci->bucket_mask];
+  while (*link != i) {
+    link = &ci->entries[*link].chain;
+  }
+  *link = ci->entries[i].chain;
+}
+
+// Finds room for a sector that isn't cached, evicting the least
+// recently used clean one. Only waits for the flusher if every sector
+// in the cache is dirty.
+static int cache_insert(struct CachedImage *ci, uint32_t sector) {
+  int i;
+  if (ci->count < ci->capacity) {
+    i = ci->count++;
+  } else {
+    for (;;) {
+      i = ci->tail;
+      while (i >= 0 && ci->entries[i].dirty) {
+        i = ci->entries[i].prev;
+      }
+      if (i >= 0) {
+        break;
+      }
+      pthread_cond_signal(&ci->work);
+      pthread_cond_wait(&ci->done, &ci->lock);
+    }
+    cache_unlink(ci, i);
+    cache_unhash(ci, i);
+  }
+  struct CacheEntry *e = &ci->entries[i];
+  e->sector = sector;
+  e->dirty = false;
+  e->chain = ci->buckets[sector & ci->bucket_mask];
+  ci->buckets[sector & ci->bucket_mask] = i;
+  e->prev = -1;
+  e->next = ci->head;
+  if (ci->head >= 0) {
+    ci->entries[ci->head].prev = i;
+  } else {
+    ci->tail = i;
+  }
+  ci->head = i;
+  return i;
+}
+
+static int compare_pending(const void *a, const void *b) {
+  uint32_t x = ((const struct PendingWrite *)a)->sector;
+  uint32_t y = ((const struct PendingWrite *)b)->sector;
+  return (x > y) - (x < y);
+}
+
+// Writes back all dirty sectors, a run of adjacent sectors at a time.
+// Called with the lock held, which is dropped while writing. Returns
+// whether there was anything to write; sectors of a run that couldn't
+// be written stay dirty and set *failed.
+static bool cache_write_back(struct CachedImage *ci, bool *failed) {
+  int n = 0;
+  for (int i = 0; i < ci->count; i++) {
+    struct CacheEntry *e = &ci->entries[i];
+    if (e->dirty) {
+      ci->pending[n++] = (struct PendingWrite) { e->sector, i, e->version, false };
+    }
+  }
+  if (n == 0) {
+    return false;
+  }
+  qsort(ci->pending, (size_t)n, sizeof(ci->pending[0]), compare_pending);
+  for (int i = 0; i < n; i++) {
+    words_to_bytes(ci->buf + (size_t)i * SECTOR_SIZE, ci->entries[ci->pending[i].entry].words);
+  }
+  pthread_mutex_unlock(&ci->lock);
+
+  for (int start = 0, end; start < n; start = end) {
+    end = start + 1;
+    while (end < n && ci->pending[end].sector == ci->pending[end-1].sector + 1) {
+      end++;
+    }
+    const uint8_t *bytes = ci->buf + (size_t)start * SECTOR_SIZE;
+    size_t size = (size_t)(end - start) * SECTOR_SIZE;
+    off_t offset = (off_t)ci->pending[start].sector * SECTOR_SIZE;
+    bool ok = true;
+    while (size > 0) {
+      ssize_t written = pwrite(ci->fd, bytes, size, offset);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        fprintf(stderr, "Can't write disk image: %s\n", strerror(errno));
+        ok = false;
+        break;
+      }
+      bytes += written;
+      size -= (size_t)written;
+      offset += written;
+    }
+    for (int i = start; i < end; i++) {
+      ci->pending[i].written = ok;
+    }
+    *failed |= !ok;
+  }
+
+  pthread_mutex_lock(&ci->lock);
+  for (int i = 0; i < n; i++) {
+    struct CacheEntry *e = &ci->entries[ci->pending[i].entry];
+    if (ci->pending[i].written && e->dirty && e->version == ci->pending[i].version) {
+      e->dirty = false;
+      ci->dirty--;
+    }
+  }
+  return true;
+}
+
+static struct timespec deadline_ms(int ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (long)(ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return ts;
+}
+
+static bool cache_urgent(struct CachedImage *ci) {
+  return ci->stop || ci->syncs_done != ci->syncs_wanted || ci->dirty > ci->capacity / 2;
+}
+
+static void *cache_flusher(void *arg) {
+  struct CachedImage *ci = arg;
+  bool unsynced = false;
+  uint64_t last_sync = now_ms();
+  pthread_mutex_lock(&ci->lock);
+  for (;;) {
+    while (ci->dirty == 0 && !cache_urgent(ci)) {
+      if (unsynced && ci->sync_ms > 0) {
+        uint64_t elapsed = now_ms() - last_sync;
+        if (elapsed >= (uint64_t)ci->sync_ms) {
+          break;
+        }
+        struct timespec ts = deadline_ms(ci->sync_ms - (int)elapsed);
+        pthread_cond_timedwait(&ci->work, &ci->lock, &ts);
+      } else {
+        pthread_cond_wait(&ci->work, &ci->lock);
+      }
+    }
+    // Give a burst of writes time to gather.
+    if (ci->dirty > 0 && !cache_urgent(ci)) {
+      struct timespec ts = deadline_ms(CACHE_DELAY_MS);
+      while (!cache_urgent(ci) && pthread_cond_timedwait(&ci->work, &ci->lock, &ts) == 0) {
+      }
+    }
+    uint64_t syncs_wanted = ci->syncs_wanted;
+    bool failed = false;
+    unsynced |= cache_write_back(ci, &failed);
+    if (unsynced && (syncs_wanted != ci->syncs_done || ci->stop ||
+                     (ci->sync_ms > 0 && now_ms() - last_sync >= (uint64_t)ci->sync_ms))) {
+      pthread_mutex_unlock(&ci->lock);
+      fdatasync(ci->fd);
+      pthread_mutex_lock(&ci->lock);
+      unsynced = false;
+      last_sync = now_ms();
+    }
+    ci->syncs_done = syncs_wanted;
+    pthread_cond_broadcast(&ci->done);
+    if (ci->stop && (ci->dirty == 0 || failed)) {
+      // Whatever couldn't be written now is lost.
+      break;
+    }
+    if (failed) {
+      // Don't hammer a failing disk, even if the cache is full of
+      // dirty sectors.
+      struct timespec ts = deadline_ms(CACHE_RETRY_MS);
+      while (!ci->stop && ci->syncs_done == ci->syncs_wanted &&
+             pthread_cond_timedwait(&ci->work, &ci->lock, &ts) == 0) {
+      }
+    }
+  }
+  pthread_mutex_unlock(&ci->lock);
+  return NULL;
+}
+
+static void cache_read(struct DiskImage *image, uint32_t sector, uint32_t *buf) {
+  struct CachedImage *ci = (struct CachedImage *)image;
+  pthread_mutex_lock(&ci->lock);
+  int i = cache_lookup(ci, sector);
+  if (i >= 0) {
+    cache_touch(ci, i);
+  } else {
+    // Not cached, so not being written back either: the file is up to date.
+    i = cache_insert(ci, sector);
+    uint8_t bytes[SECTOR_SIZE] = { 0 };
+    ssize_t n;
+    do {
+      n = pread(ci->fd, bytes, SECTOR_SIZE, (off_t)sector * SECTOR_SIZE);
+    } while (n < 0 && errno == EINTR);
+    bytes_to_words(ci->entries[i].words, bytes);
+  }
+  memcpy(buf, ci->entries[i].words, SECTOR_SIZE);
+  pthread_mutex_unlock(&ci->lock);
+}
+
+static void cache_write(struct DiskImage *image, uint32_t sector, const uint32_t *buf) {
+  struct CachedImage *ci = (struct CachedImage *)image;
+  pthread_mutex_lock(&ci->lock);
+  int i = cache_lookup(ci, sector);
+  if (i >= 0) {
+    cache_touch(ci, i);
+  } else {
+    i = cache_insert(ci, sector);
+  }
+  struct CacheEntry *e = &ci->entries[i];
+  memcpy(e->words, buf, SECTOR_SIZE);
+  e->version++;
+  if (!e->dirty) {
+    e->dirty = true;
+    ci->dirty++;
+    if (ci->dirty == 1 || ci->dirty > ci->capacity / 2) {
+      pthread_cond_signal(&ci->work);
+    }
+  }
+  pthread_mutex_unlock(&ci->lock);
+}
+
+// Called with the lock held.
+static void cache_wait_synced(struct CachedImage *ci) {
+  uint64_t ticket = ++ci->syncs_wanted;
+  pthread_cond_signal(&ci->work);
+  while (ci->syncs_done < ticket) {
+    pthread_cond_wait(&ci->done, &ci->lock);
+  }
+}
+
+static void cache_sync(struct DiskImage *image) {
+  struct CachedImage *ci = (struct CachedImage *)image;
+  pthread_mutex_lock(&ci->lock);
+  cache_wait_synced(ci);
+  pthread_mutex_unlock(&ci->lock);
+}
+
+static void cache_trim(struct DiskImage *image, uint32_t sector) {
+  struct CachedImage *ci = (struct CachedImage *)image;
+  pthread_mutex_lock(&ci->lock);
+  // Nothing may be written past the new end once it is cut off.
+  cache_wait_synced(ci);
+  // Sectors whose write-back failed are still dirty, and may be cut
+  // off here too.
+  int kept = 0;
+  ci->dirty = 0;
+  for (int i = 0; i < ci->count; i++) {
+    if (ci->entries[i].sector < sector) {
+      ci->dirty += ci->entries[i].dirty;
+      ci->entries[kept++] = ci->entries[i];
+    }
+  }
+  ci->count = kept;
+  ci->head = ci->tail = -1;
+  memset(ci->buckets, -1, (ci->bucket_mask + 1) * sizeof(ci->buckets[0]));
+  for (int i = 0; i < kept; i++) {
+    struct CacheEntry *e = &ci->entries[i];
+    e->chain = ci->buckets[e->sector & ci->bucket_mask];
+    ci->buckets[e->sector & ci->bucket_mask] = i;
+    e->prev = ci->tail;
+    e->next = -1;
+    if (ci->tail >= 0) {
+      ci->entries[ci->tail].next = i;
+    } else {
+      ci->head = i;
+    }
+    ci->tail = i;
+  }
+  ftruncate(ci->fd, (off_t)sector * SECTOR_SIZE);
+  pthread_mutex_unlock(&ci->lock);
+}
+
+static void cache_close(struct DiskImage *image) {
+  struct CachedImage *ci = (struct CachedImage *)image;
+  pthread_mutex_lock(&ci->lock);
+  ci->stop = true;
+  pthread_cond_signal(&ci->work);
+  pthread_mutex_unlock(&ci->lock);
+  pthread_join(ci->flusher, NULL);
+  close(ci->fd);
+  pthread_mutex_destroy(&ci->lock);
+  pthread_cond_destroy(&ci->work);
+  pthread_cond_destroy(&ci->done);
+  free(ci->entries);
+  free(ci->buckets);
+  free(ci->pending);
+  free(ci->buf);
+  free(ci);
+}
+
+struct DiskImage *disk_image_cache(const char *filename, int cache_sectors, int sync_ms) {
+  if (cache_sectors < 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+  int fd = open(filename, O_RDWR);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct CachedImage *ci = calloc(1, sizeof(*ci));
+  ci->image = (struct DiskImage) {
+    .read = cache_read,
+    .write = cache_write,
+    .sync = cache_sync,
+    .trim = cache_trim,
+    .close = cache_close
+  };
+  ci->fd = fd;
+  ci->sync_ms = sync_ms;
+  ci->capacity = cache_sectors;
+  uint32_t buckets = 1;
+  while (buckets < (uint32_t)cache_sectors) {
+    buckets *= 2;
+  }
+  ci->bucket_mask = buckets - 1;
+  ci->entries = calloc((size_t)cache_sectors, sizeof(ci->entries[0]));
+  ci->buckets = malloc(buckets * sizeof(ci->buckets[0]));
+  ci->pending = calloc((size_t)cache_sectors, sizeof(ci->pending[0]));
+  ci->buf = malloc((size_t)cache_sectors * SECTOR_SIZE);
+  if (!ci->entries || !ci->buckets || !ci->pending || !ci->buf) {
+    fprintf(stderr, "Can't allocate a disk cache of %d sectors\n", cache_sectors);
+    exit(1);
+  }
+  memset(ci->buckets, -1, buckets * sizeof(ci->buckets[0]));
+  ci->head = ci->tail = -1;
+  pthread_mutex_init(&ci->lock, NULL);
+  pthread_cond_init(&ci->work, NULL);
+  pthread_cond_init(&ci->done, NULL);
+  int err = pthread_create(&ci->flusher, NULL, cache_flusher, ci);
+  if (err != 0) {
+    close(fd);
+    free(ci->entries);
+    free(ci->buckets);
+    free(ci->pending);
+    free(ci->buf);
+    free(ci);
+    errno = err;
+    return NULL;
+  }
+  return &ci->image;
+}
+
+#else  // !DISK_CACHE
+
+struct DiskImage *disk_image_cache(const char *filename, int cache_sectors, int sync_ms) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+#endif  // DISK_CACHE
+
+
+#if DISK_MMAP
+
+struct OverlayImage {
+  struct DiskImage image;
+  const uint8_t *base;  // mapped read-only, so instances share its pages
+  uint64_t base_size;
+  int fd;
+  uint32_t length;      // of the image, in sectors
+  uint32_t visible;     // sectors of the base that no trim has cut off
+  // For each sector, its record in the overlay plus one, or 0.
+  uint32_t *records;
+  uint32_t records_size;
+  uint32_t record_count;
+  // Records left over by trims, to be used again.
+  uint32_t *free;
+  uint32_t free_count, free_size;
+};
+
+static bool full_pwrite(int fd, const uint8_t *bytes, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, bytes, size, offset);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    bytes += written;
+    size -= (size_t)written;
+    offset += written;
+  }
+  return true;
+}
+
+static bool full_pread(int fd, uint8_t *bytes, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n = pread(fd, bytes, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;  // cut short
+      }
+      return false;
+    }
+    bytes += n;
+    size -= (size_t)n;
+    offset += n;
+  }
+  return true;
+}
+
+static off_t record_offset(uint32_t record) {
+  return COW_HEADER + (off_t)record * COW_RECORD;
+}
+
+static bool overlay_write_header(struct OverlayImage *oi) {
+  uint8_t header[COW_HEADER] = { 0 };
+  memcpy(header, COW_MAGIC, 8);
+  store_le(header + 8, (uint32_t)oi->base_size);
+  store_le(header + 12, (uint32_t)(oi->base_size >> 32));
+  store_le(header + 16, oi->length);
+  store_le(header + 20, oi->visible);
+  return full_pwrite(oi->fd, header, sizeof(header), 0);
+}
+
+static bool overlay_set_record(struct OverlayImage *oi, uint32_t sector, uint32_t record) {
+  if (sector >= oi->records_size) {
+    uint32_t size = oi->records_size ? oi->records_size : 1024;
+    while (size <= sector) {
+      if (size > UINT32_MAX / 2) {
+        return false;
+      }
+      size *= 2;
+    }
+    uint32_t *records = realloc(oi->records, size * sizeof(records[0]));
+    if (!records) {
+      return false;
+    }
+    memset(records + oi->records_size, 0, (size - oi->records_size) * sizeof(records[0]));
+    oi->records = records;
+    oi->records_size = size;
+  }
+  oi->records[sector] = record + 1;
+  return true;
+}
+
+static void overlay_free_record(struct OverlayImage *oi, uint32_t record) {
+  if (oi->free_count == oi->free_size) {
+    uint32_t size = oi->free_size ? oi->free_size * 2 : 64;
+    uint32_t *free_records = realloc(oi->free, size * sizeof(free_records[0]));
+    if (!free_records) {
+      return;  // the record is lost until the overlay is opened again
+    }
+    oi->free = free_records;
+    oi->free_size = size;
+  }
+  oi->free[oi->free_count++] = record;
+}
+
+static void overlay_read(struct DiskImage *image, uint32_t sector, uint32_t *buf) {
+  struct OverlayImage *oi = (struct OverlayImage *)image;
+  uint8_t bytes[SECTOR_SIZE] = { 0 };
+  if (sector < oi->length) {
+    if (sector < oi->records_size && oi->records[sector]) {
+      if (!full_pread(oi->fd, bytes, SECTOR_SIZE, record_offset(oi->records[sector] - 1) + 4)) {
+        fprintf(stderr, "Can't read overlay: %s\n", strerror(errno));
+        memset(bytes, 0, sizeof(bytes));
+      }
+    } else if (sector < oi->visible) {
+      uint64_t start = (uint64_t)sector * SECTOR_SIZE;
+      uint64_t end = start + SECTOR_SIZE < oi->base_size ? start + SECTOR_SIZE : oi->base_size;
+      memcpy(bytes, oi->base + start, (size_t)(end - start));
+    }
+  }
+  bytes_to_words(buf, bytes);
+}
+
+static void overlay_write(struct DiskImage *image, uint32_t sector, const uint32_t *buf) {
+  struct OverlayImage *oi = (struct OverlayImage *)image;
+  uint32_t record;
+  if (sector < oi->records_size && oi->records[sector]) {
+    record = oi->records[sector] - 1;
+  } else {
+    record = oi->free_count ? oi->free[--oi->free_count] : oi->record_count++;
+    if (!overlay_set_record(oi, sector, record)) {
+      fprintf(stderr, "Can't index overlay sector %u\n", (unsigned)sector);
+      exit(1);
+    }
+  }
+  uint8_t bytes[COW_RECORD];
+  store_le(bytes, sector);
+  words_to_bytes(bytes + 4, buf);
+  if (!full_pwrite(oi->fd, bytes, sizeof(bytes), record_offset(record))) {
+    fprintf(stderr, "Can't write overlay: %s\n", strerror(errno));
+  }
+  if (sector >= oi->length) {
+    oi->length = sector + 1;
+    overlay_write_header(oi);
+  }
+}
+
+static void overlay_sync(struct DiskImage *image) {
+  struct OverlayImage *oi = (struct OverlayImage *)image;
+  fdatasync(oi->fd);
+}
+
+static void overlay_trim(struct DiskImage *image, uint32_t sector) {
+  struct OverlayImage *oi = (struct OverlayImage *)image;
+  uint8_t tag[4];
+  store_le(tag, COW_FREE);
+  for (uint32_t s = sector; s < oi->records_size; s++) {
+    if (oi->records[s]) {
+      full_pwrite(oi->fd, tag, sizeof(tag), record_offset(oi->records[s] - 1));
+      overlay_free_record(oi, oi->records[s] - 1);
+      oi->records[s] = 0;
+    }
+  }
+  if (oi->visible > sector) {
+    oi->visible = sector;
+  }
+  oi->length = sector;
+  overlay_write_header(oi);
+}
+
+static void overlay_close(struct DiskImage *image) {
+  struct OverlayImage *oi = (struct OverlayImage *)image;
+  if (oi->base) {
+    munmap((void *)oi->base, (size_t)oi->base_size);
+  }
+  close(oi->fd);
+  free(oi->records);
+  free(oi->free);
+  free(oi);
+}
+
+// Creates the header of a new overlay, or reads the header and the
+// index of an existing one.
+static bool overlay_load(struct OverlayImage *oi) {
+  struct stat st;
+  if (fstat(oi->fd, &st) != 0) {
+    return false;
+  }
+  if (st.st_size == 0) {
+    oi->length = oi->visible = (uint32_t)((oi->base_size + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    return overlay_write_header(oi);
+  }
+  uint8_t header[COW_HEADER];
+  if (!full_pread(oi->fd, header, sizeof(header), 0) || memcmp(header, COW_MAGIC, 8) != 0) {
+    errno = EINVAL;
+    return false;
+  }
+  uint64_t base_size = load_le(header + 8) | (uint64_t)load_le(header + 12) << 32;
+  if (base_size != oi->base_size) {
+    // Made for some other base image.
+    errno = EINVAL;
+    return false;
+  }
+  oi->length = load_le(header + 16);
+  oi->visible = load_le(header + 20);
+
+  // A record cut short by a crash is ignored, and overwritten by the
+  // next new sector.
+  uint64_t count = ((uint64_t)st.st_size - COW_HEADER) / COW_RECORD;
+  if (count > UINT32_MAX) {
+    errno = EFBIG;
+    return false;
+  }
+  oi->record_count = (uint32_t)count;
+  for (uint32_t record = 0; record < oi->record_count; record++) {
+    uint8_t tag[4];
+    if (!full_pread(oi->fd, tag, sizeof(tag), record_offset(record))) {
+      return false;
+    }
+    uint32_t sector = load_le(tag);
+    if (sector == COW_FREE || sector >= oi->length) {
+      overlay_free_record(oi, record);
+    } else if (!overlay_set_record(oi, sector, record)) {
+      errno = ENOMEM;
+      return false;
+    }
+  }
+  return true;
+}
+
+struct DiskImage *disk_image_overlay(const char *base, const char *overlay) {
+  int base_fd = open(base, O_RDONLY);
+  if (base_fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(base_fd, &st) != 0 || (uint64_t)st.st_size > SIZE_MAX) {
+    int err = (uint64_t)st.st_size > SIZE_MAX ? EFBIG : errno;
+    close(base_fd);
+    errno = err;
+    return NULL;
+  }
+  struct OverlayImage *oi = calloc(1, sizeof(*oi));
+  oi->image = (struct DiskImage) {
+    .read = overlay_read,
+    .write = overlay_write,
+    .sync = overlay_sync,
+    .trim = overlay_trim,
+    .close = overlay_close
+  };
+  oi->base_size = (uint64_t)st.st_size;
+  if (oi->base_size > 0) {
+    void *map = mmap(NULL, (size_t)oi->base_size, PROT_READ, MAP_SHARED, base_fd, 0);
+    if (map == MAP_FAILED) {
+      int err = errno;
+      close(base_fd);
+      free(oi);
+      errno = err;
+      return NULL;
+    }
+    oi->base = map;
+  }
+  close(base_fd);
+  oi->fd = open(overlay, O_RDWR | O_CREAT, 0666);
+  if (oi->fd < 0 || !overlay_load(oi)) {
+    int err = errno;
+    if (oi->fd >= 0) {
+      close(oi->fd);
+    }
+    oi->fd = -1;
+    if (oi->base) {
+      munmap((void *)oi->base, (size_t)oi->base_size);
+    }
+    free(oi->records);
+    free(oi->free);
+    free(oi);
+    errno = err;
+    return NULL;
+  }
+  return &oi->image;
+}
+
+#else  // !DISK_MMAP
+
+struct DiskImage *disk_image_overlay(const char *base, const char *overlay) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+#endif  // DISK_MMAP
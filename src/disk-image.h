@@ -0,0 +1,46 @@
+#ifndef DISK_IMAGE_H
+#define DISK_IMAGE_H
+
+#include <stdint.h>
+
+#define SECTOR_SIZE 512
+
+// Where the SD card keeps its sectors. A sector is passed around as the
+// 128 words that go over SPI, each holding four bytes of the image with
+// the first one in the low bits.
+struct DiskImage {
+  // Sectors past the end of the image read as zeros.
+  void (*read)(struct DiskImage *image, uint32_t sector, uint32_t *buf);
+  void (*write)(struct DiskImage *image, uint32_t sector, const uint32_t *buf);
+  // Returns once everything written so far is on disk.
+  void (*sync)(struct DiskImage *image);
+  // Cuts the image off where sector starts.
+  void (*trim)(struct DiskImage *image, uint32_t sector);
+  // Writes back outstanding changes and frees the image.
+  void (*close)(struct DiskImage *image);
+};
+
+// These return NULL and set errno if the file can't be used.
+
+// Reads and writes the file a sector at a time through stdio.
+struct DiskImage *disk_image_open(const char *filename);
+
+// Maps the whole file into memory, so that sectors are copied straight
+// to and from the page cache. Changes are written back to disk when the
+// image is closed and, if sync_ms is positive, by the first write at
+// least sync_ms milliseconds after the previous write-back.
+struct DiskImage *disk_image_map(const char *filename, int sync_ms);
+
+// Keeps the cache_sectors most recently used sectors in memory. Writes
+// only go to the cache: a background thread writes changed sectors
+// back shortly afterwards, a run of adjacent sectors at a time, and if
+// sync_ms is positive flushes them to disk at least that often. Only
+// reads of sectors that aren't cached wait for the file.
+struct DiskImage *disk_image_cache(const char *filename, int cache_sectors, int sync_ms);
+
+// Reads sectors from base, which is never written, unless they were
+// written through this image: those are kept in the overlay file,
+// which only holds the sectors that differ and is created if needed.
+struct DiskImage *disk_image_overlay(const char *base, const char *overlay);
+
+#endif  // DISK_IMAGE_H
@@ -1,6 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -11,6 +12,7 @@
 #include <time.h>
 #include <unistd.h>
 #include "disk.h"
+#include "disk-image.h"
 
 enum DiskState {
   diskCommand,
@@ -21,58 +23,161 @@ enum DiskState {
 
 struct Disk {
   struct RISC_SPI spi;
+  struct RISC_DiskDMA dma;
 
   enum DiskState state;
-  FILE *file;
+  struct DiskImage *image;
   uint32_t offset;
+  uint32_t sector;  // being written
 
-  uint32_t rx_buf[128];
+  // Bytes from the host: a command, or a sector and its checksum.
+  uint8_t rx_buf[512+2];
   int rx_idx;
 
-  uint32_t tx_buf[128+2];
+  // Bytes to the host: a response, or that and a sector.
+  uint8_t tx_buf[2+512];
   int tx_cnt;
   int tx_idx;
+
+  uint32_t received;  // by the host during the last transfer
 };
 
 
 static uint32_t disk_read(const struct RISC_SPI *spi);
-static void disk_write(const struct RISC_SPI *spi, uint32_t value);
+static void disk_write(const struct RISC_SPI *spi, uint32_t value, bool fast);
+static bool disk_shift_word(struct Disk *disk, uint32_t value);
+static uint8_t disk_shift(struct Disk *disk, uint8_t value);
 static void disk_run_command(struct Disk *disk);
-static void seek_sector(FILE *f, uint32_t secnum);
-static void read_sector(FILE *f, uint32_t buf[static 128]);
-static void write_sector(FILE *f, uint32_t buf[static 128]);
+static struct DiskImage *open_image(const char *filename, const struct DiskOptions *options);
+static bool disk_dma_read(const struct RISC_DiskDMA *dma, uint32_t block, uint32_t count, uint32_t *dst);
+static bool disk_dma_write(const struct RISC_DiskDMA *dma, uint32_t block, uint32_t count, const uint32_t *src);
+static void read_sector(struct Disk *disk, uint32_t sector, uint32_t buf[static 128]);
+static void write_sector(struct Disk *disk, uint32_t sector, const uint32_t buf[static 128]);
 
 
-struct RISC_SPI *disk_new(const char *filename) {
+// "base.dsk+overlay.cow" names an overlay on a base image, unless there
+// is a file of that name.
+static struct DiskImage *open_image(const char *filename, const struct DiskOptions *options) {
+  const char *plus = strrchr(filename, '+');
+  struct stat st;
+  if (plus && plus != filename && plus[1] && stat(filename, &st) != 0) {
+    if (options && (options->mmap || options->cache_sectors > 0 || options->sync_ms > 0)) {
+      fprintf(stderr, "Overlay \"%s\" can't be memory-mapped, cached or synced periodically\n", filename);
+      exit(1);
+    }
+    char *base = strndup(filename, (size_t)(plus - filename));
+    struct DiskImage *image = disk_image_overlay(base, plus + 1);
+    free(base);
+    return image;
+  }
+  if (options && options->mmap) {
+    return disk_image_map(filename, options->sync_ms);
+  }
+  if (options && options->cache_sectors > 0) {
+    return disk_image_cache(filename, options->cache_sectors, options->sync_ms);
+  }
+  return disk_image_open(filename);
+}
+
+struct RISC_SPI *disk_new(const char *filename, const struct DiskOptions *options) {
   struct Disk *disk = calloc(1, sizeof(*disk));
   disk->spi = (struct RISC_SPI) {
     .read_data = disk_read,
     .write_data = disk_write
   };
+  disk->dma = (struct RISC_DiskDMA) {
+    .read = disk_dma_read,
+    .write = disk_dma_write
+  };
 
   disk->state = diskCommand;
 
   if (filename) {
-    disk->file = fopen(filename, "rb+");
-    if (disk->file == 0) {
+    disk->image = open_image(filename, options);
+    if (disk->image == NULL) {
       fprintf(stderr, "Can't open file \"%s\": %s\n", filename, strerror(errno));
       exit(1);
     }
 
     // Check for filesystem-only image, starting directly at sector 1 (DiskAdr 29)
-    read_sector(disk->file, &disk->tx_buf[0]);
-    disk->offset = (disk->tx_buf[0] == 0x9B1EA38D) ? 0x80002 : 0;
+    uint32_t buf[128];
+    read_sector(disk, 0, buf);
+    disk->offset = (buf[0] == 0x9B1EA38D) ? 0x80002 : 0;
   }
 
   return &disk->spi;
 }
 
-static void disk_write(const struct RISC_SPI *spi, uint32_t value) {
+const struct RISC_DiskDMA *disk_get_dma(const struct RISC_SPI *spi) {
+  const struct Disk *disk = (const struct Disk *)spi;
+  return disk->image ? &disk->dma : NULL;
+}
+
+void disk_sync(const struct RISC_SPI *spi) {
   struct Disk *disk = (struct Disk *)spi;
+  if (disk->image) {
+    disk->image->sync(disk->image);
+  }
+}
+
+void disk_free(const struct RISC_SPI *spi) {
+  struct Disk *disk = (struct Disk *)spi;
+  if (disk->image) {
+    disk->image->close(disk->image);
+  }
+  free(disk);
+}
+
+static uint32_t load_le(const uint8_t *bytes) {
+  return (uint32_t)bytes[0]
+    | ((uint32_t)bytes[1] << 8)
+    | ((uint32_t)bytes[2] << 16)
+    | ((uint32_t)bytes[3] << 24);
+}
+
+static void store_le(uint8_t *bytes, uint32_t value) {
+  bytes[0] = (uint8_t)value;
+  bytes[1] = (uint8_t)(value >> 8);
+  bytes[2] = (uint8_t)(value >> 16);
+  bytes[3] = (uint8_t)(value >> 24);
+}
+
+static void disk_write(const struct RISC_SPI *spi, uint32_t value, bool fast) {
+  struct Disk *disk = (struct Disk *)spi;
+  if (!fast) {
+    disk->received = disk_shift(disk, (uint8_t)value);
+  } else if (!disk_shift_word(disk, value)) {
+    disk->received = 0;
+    for (int i = 0; i < 32; i += 8) {
+      disk->received |= (uint32_t)disk_shift(disk, (uint8_t)(value >> i)) << i;
+    }
+  }
+}
+
+// A fast transfer in the middle of a sector moves four bytes of it
+// and nothing else, so it needn't go through disk_shift byte by byte.
+static bool disk_shift_word(struct Disk *disk, uint32_t value) {
+  if (disk->state == diskRead && disk->tx_idx + 4 < disk->tx_cnt) {
+    disk->received = load_le(&disk->tx_buf[disk->tx_idx + 1]);
+    disk->tx_idx += 4;
+    return true;
+  }
+  if (disk->state == diskWriting && disk->rx_idx + 4 < 512 && disk->tx_idx + 1 >= disk->tx_cnt) {
+    store_le(&disk->rx_buf[disk->rx_idx], value);
+    disk->rx_idx += 4;
+    disk->tx_idx += 4;
+    disk->received = 0xFFFFFFFF;
+    return true;
+  }
+  return false;
+}
+
+// Exchanges one byte with the host.
+static uint8_t disk_shift(struct Disk *disk, uint8_t value) {
   disk->tx_idx++;
   switch (disk->state) {
     case diskCommand: {
-      if ((uint8_t)value != 0xFF || disk->rx_idx != 0) {
+      if (value != 0xFF || disk->rx_idx != 0) {
         disk->rx_buf[disk->rx_idx] = value;
         disk->rx_idx++;
         if (disk->rx_idx == 6) {
@@ -97,14 +202,16 @@ static void disk_write(const struct RISC_SPI *spi, uint32_t value) {
       break;
     }
     case diskWriting: {
-      if (disk->rx_idx < 128) {
-        disk->rx_buf[disk->rx_idx] = value;
-      }
+      disk->rx_buf[disk->rx_idx] = value;
       disk->rx_idx++;
-      if (disk->rx_idx == 128) {
-        write_sector(disk->file, &disk->rx_buf[0]);
+      if (disk->rx_idx == 512) {
+        uint32_t buf[128];
+        for (int i = 0; i < 128; i++) {
+          buf[i] = load_le(&disk->rx_buf[i * 4]);
+        }
+        write_sector(disk, disk->sector, buf);
       }
-      if (disk->rx_idx == 130) {
+      if (disk->rx_idx == 512+2) {
         disk->tx_buf[0] = 5;
         disk->tx_cnt = 1;
         disk->tx_idx = -1;
@@ -114,39 +221,40 @@ static void disk_write(const struct RISC_SPI *spi, uint32_t value) {
       break;
     }
   }
+  if (disk->tx_idx >= 0 && disk->tx_idx < disk->tx_cnt) {
+    return disk->tx_buf[disk->tx_idx];
+  }
+  return 255;
 }
 
 static uint32_t disk_read(const struct RISC_SPI *spi) {
-  struct Disk *disk = (struct Disk *)spi;
-  uint32_t result;
-  if (disk->tx_idx >= 0 && disk->tx_idx < disk->tx_cnt) {
-    result = disk->tx_buf[disk->tx_idx];
-  } else {
-    result = 255;
-  }
-  return result;
+  const struct Disk *disk = (const struct Disk *)spi;
+  return disk->received;
 }
 
 static void disk_run_command(struct Disk *disk) {
   uint32_t cmd = disk->rx_buf[0];
-  uint32_t arg = (disk->rx_buf[1] << 24)
-    | (disk->rx_buf[2] << 16)
-    | (disk->rx_buf[3] << 8)
+  uint32_t arg = ((uint32_t)disk->rx_buf[1] << 24)
+    | ((uint32_t)disk->rx_buf[2] << 16)
+    | ((uint32_t)disk->rx_buf[3] << 8)
     | disk->rx_buf[4];
 
   switch (cmd) {
     case 81: {
+      uint32_t buf[128];
+      read_sector(disk, arg - disk->offset, buf);
+      for (int i = 0; i < 128; i++) {
+        store_le(&disk->tx_buf[2 + i * 4], buf[i]);
+      }
       disk->state = diskRead;
       disk->tx_buf[0] = 0;
       disk->tx_buf[1] = 254;
-      seek_sector(disk->file, arg - disk->offset);
-      read_sector(disk->file, &disk->tx_buf[2]);
-      disk->tx_cnt = 2 + 128;
+      disk->tx_cnt = 2 + 512;
       break;
     }
     case 88: {
       disk->state = diskWrite;
-      seek_sector(disk->file, arg - disk->offset);
+      disk->sector = arg - disk->offset;
       disk->tx_buf[0] = 0;
       disk->tx_cnt = 1;
       break;
@@ -160,40 +268,55 @@ static void disk_run_command(struct Disk *disk) {
   disk->tx_idx = -1;
 }
 
-static void seek_sector(FILE *f, uint32_t secnum) {
-  if (f) {
-    fseek(f, secnum * 512, SEEK_SET);
+// The same as a run of SPI read and write commands, one per block.
+static bool disk_dma_read(const struct RISC_DiskDMA *dma, uint32_t block, uint32_t count, uint32_t *dst) {
+  struct Disk *disk = (struct Disk *)((char *)dma - offsetof(struct Disk, dma));
+  if (!disk->image) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    read_sector(disk, block + i - disk->offset, dst + i * 128);
   }
+  return true;
 }
 
-static void read_sector(FILE *f, uint32_t buf[static 128]) {
-  uint8_t bytes[512] = { 0 };
-  if (f) {
-    fread(bytes, 512, 1, f);
+static bool disk_dma_write(const struct RISC_DiskDMA *dma, uint32_t block, uint32_t count, const uint32_t *src) {
+  struct Disk *disk = (struct Disk *)((char *)dma - offsetof(struct Disk, dma));
+  if (!disk->image) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    write_sector(disk, block + i - disk->offset, src + i * 128);
   }
-  for (int i = 0; i < 128; i++) {
-    buf[i] = (uint32_t)bytes[i*4+0]
-      | ((uint32_t)bytes[i*4+1] << 8)
-      | ((uint32_t)bytes[i*4+2] << 16)
-      | ((uint32_t)bytes[i*4+3] << 24);
+  return true;
+}
+
+static void read_sector(struct Disk *disk, uint32_t sector, uint32_t buf[static 128]) {
+  if (disk->image) {
+    disk->image->read(disk->image, sector, buf);
+  } else {
+    memset(buf, 0, 128 * sizeof(uint32_t));
   }
 }
 
-static void write_sector(FILE *f, uint32_t buf[static 128]) {
-  if (f) {
-    uint8_t bytes[512];
-    for (int i = 0; i < 128; i++) {
-      bytes[i*4+0] = (uint8_t)(buf[i]      );
-      bytes[i*4+1] = (uint8_t)(buf[i] >>  8);
-      bytes[i*4+2] = (uint8_t)(buf[i] >> 16);
-      bytes[i*4+3] = (uint8_t)(buf[i] >> 24);
+// A sector framed by these markers asks for the image to be cut off there.
+static bool is_trim_sector(const uint32_t buf[static 128]) {
+  static const char head[] = "!!TRIM!!----", tail[] = "----!!TRIM!!";
+  for (int i = 0; i < 12; i++) {
+    if ((uint8_t)(buf[i / 4] >> (i % 4 * 8)) != (uint8_t)head[i] ||
+        (uint8_t)(buf[125 + i / 4] >> (i % 4 * 8)) != (uint8_t)tail[i]) {
+      return false;
     }
-    if (memcmp(bytes, "!!TRIM!!----", 12) == 0 && memcmp(bytes + 500, "----!!TRIM!!", 12) == 0) {
-      fflush(f);
-      ftruncate(fileno(f), ftell(f));
-      f = freopen(NULL, "rb+", f);
+  }
+  return true;
+}
+
+static void write_sector(struct Disk *disk, uint32_t sector, const uint32_t buf[static 128]) {
+  if (disk->image) {
+    if (is_trim_sector(buf)) {
+      disk->image->trim(disk->image, sector);
     } else {
-      fwrite(bytes, 512, 1, f);
+      disk->image->write(disk->image, sector, buf);
     }
   }
 }
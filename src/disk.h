@@ -1,9 +1,27 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdbool.h>
 #include "risc-io.h"
 
-struct RISC_SPI *disk_new(const char *filename);
+struct DiskOptions {
+  bool mmap;          // map the image into memory instead of going through stdio
+  int cache_sectors;  // otherwise, cache this many sectors and write back in the background
+  int sync_ms;        // with either, how often to flush changes to disk (0: only on sync)
+};
+
+// filename may be NULL for no disk, options NULL for the defaults. A
+// filename of the form "base.dsk+overlay.cow" leaves base.dsk as it is
+// and keeps changed sectors in overlay.cow, creating it if needed; the
+// options don't apply to it.
+struct RISC_SPI *disk_new(const char *filename, const struct DiskOptions *options);
+// Returns once all changes so far are on disk.
+void disk_sync(const struct RISC_SPI *spi);
+// Writes back outstanding changes and closes the image.
+void disk_free(const struct RISC_SPI *spi);
+// Transfers blocks of the same disk without going through SPI, for
+// risc_set_disk_dma. NULL if the disk has no image.
+const struct RISC_DiskDMA *disk_get_dma(const struct RISC_SPI *spi);
 
 struct RISC_HostFS *host_fs_new(const char *directory);
 
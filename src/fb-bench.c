@@ -0,0 +1,117 @@
+// Times the framebuffer conversions in fb-convert.c: the bit-by-bit
+// loops, the lookup tables and whatever fb_select(FB_BEST) picks on
+// this host, on random 1024x768 frames.
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fb-convert.h"
+
+#define WIDTH  1024
+#define HEIGHT 768
+#define ROUNDS 200
+
+enum Conversion { MONO_ARGB, COLOR_ARGB, MONO_RGB565, COLOR_RGB565, CONVERSIONS };
+
+static const char *conversion_names[CONVERSIONS] = {
+  "mono argb", "color argb", "mono rgb565", "color rgb565"
+};
+
+static const char *impl_names[] = { "loops", "tables", "best" };
+
+static struct FB_Table table;
+static struct FB_Table16 table16;
+static uint32_t mono_in[WIDTH / 32 * HEIGHT];
+static uint32_t color_in[WIDTH / 8 * HEIGHT];
+static uint32_t out[WIDTH * HEIGHT];
+static uint32_t expected[CONVERSIONS][WIDTH * HEIGHT];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// One frame, converted a line at a time like the front ends do.
+static void convert(enum Conversion c) {
+  switch (c) {
+    case MONO_ARGB:
+      for (int y = 0; y < HEIGHT; y++) {
+        fb_mono_to_argb(out + y * WIDTH, mono_in + y * (WIDTH / 32), WIDTH / 32, &table);
+      }
+      break;
+    case COLOR_ARGB:
+      for (int y = 0; y < HEIGHT; y++) {
+        fb_color_to_argb(out + y * WIDTH, color_in + y * (WIDTH / 8), WIDTH / 8, &table);
+      }
+      break;
+    case MONO_RGB565:
+      for (int y = 0; y < HEIGHT; y++) {
+        uint16_t *line = (uint16_t *)out + y * WIDTH;
+        fb_mono_to_rgb565(line, mono_in + y * (WIDTH / 32), WIDTH / 32, &table16);
+      }
+      break;
+    case COLOR_RGB565:
+      for (int y = 0; y < HEIGHT; y++) {
+        uint16_t *line = (uint16_t *)out + y * WIDTH;
+        fb_color_to_rgb565(line, color_in + y * (WIDTH / 8), WIDTH / 8, &table16);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+static size_t output_size(enum Conversion c) {
+  return WIDTH * HEIGHT * (c == MONO_RGB565 || c == COLOR_RGB565 ? 2 : 4);
+}
+
+int main(void) {
+  uint32_t palette[16];
+  uint16_t palette16[16];
+  uint32_t seed = 12345;
+  for (int i = 0; i < 16; i++) {
+    seed = seed * 1103515245 + 12345;
+    palette[i] = seed >> 8;
+    palette16[i] = (uint16_t)(seed >> 16);
+  }
+  for (size_t i = 0; i < sizeof(mono_in) / sizeof(mono_in[0]); i++) {
+    seed = seed * 1103515245 + 12345;
+    mono_in[i] = seed;
+  }
+  for (size_t i = 0; i < sizeof(color_in) / sizeof(color_in[0]); i++) {
+    seed = seed * 1103515245 + 12345;
+    color_in[i] = seed;
+  }
+
+  double start = now();
+  for (int i = 0; i < ROUNDS; i++) {
+    fb_build_table(&table, palette, 16);
+    fb_build_table16(&table16, palette16, 16);
+  }
+  printf("%-14s %8.4f ms\n", "build tables", (now() - start) * 1000 / ROUNDS);
+
+  int status = 0;
+  for (int impl = FB_LOOPS; impl <= FB_BEST; impl++) {
+    fb_select(impl);
+    for (int c = 0; c < CONVERSIONS; c++) {
+      convert(c);
+      if (impl == FB_LOOPS) {
+        memcpy(expected[c], out, output_size(c));
+      } else if (memcmp(expected[c], out, output_size(c)) != 0) {
+        printf("%s %s: output differs from the loops\n", conversion_names[c], impl_names[impl]);
+        status = 1;
+      }
+      start = now();
+      for (int i = 0; i < ROUNDS; i++) {
+        convert(c);
+      }
+      printf("%-14s %-7s %8.4f ms/frame\n", conversion_names[c], impl_names[impl],
+             (now() - start) * 1000 / ROUNDS);
+    }
+  }
+  return status;
+}
@@ -0,0 +1,486 @@
+// Framebuffer expansion for the front ends.
+//
+// On x86 the loops below are vectorized by hand: a 1 bpp word becomes
+// a mask per pixel by broadcasting it and comparing against the bit
+// each lane stands for, and a 4 bpp word is looked up in the palette
+// with PSHUFB, one byte of the pixel at a time. SSE2 is part of x86-64,
+// so it is used whenever the compiler allows it; the SSSE3 and AVX2
+// versions are compiled with target attributes and picked at run time.
+// ARM builds with NEON do the same with VTST and VTBL. Everything else
+// copies whole pixels out of the tables in struct FB_Table, a byte of
+// framebuffer at a time. The bit-by-bit loops are kept for fb_select,
+// so that fb-bench can compare against them.
+
+#include <string.h>
+#include "fb-convert.h"
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define FB_X86 1
+#include <immintrin.h>
+#else
+#define FB_X86 0
+#endif
+
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARM_BIG_ENDIAN)
+#define FB_NEON 1
+#include <arm_neon.h>
+#else
+#define FB_NEON 0
+#endif
+
+static void mono_to_argb_c(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  const uint32_t zero = t->palette[0], one = t->palette[1];
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 32; b++) {
+      *out++ = (pixels & 1) ? one : zero;
+      pixels >>= 1;
+    }
+  }
+}
+
+static void color_to_argb_c(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  const uint32_t *palette = t->palette;
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 8; b++) {
+      *out++ = palette[pixels & 0xF];
+      pixels >>= 4;
+    }
+  }
+}
+
+static void mono_to_rgb565_c(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  const uint16_t zero = t->palette[0], one = t->palette[1];
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 32; b++) {
+      *out++ = (pixels & 1) ? one : zero;
+      pixels >>= 1;
+    }
+  }
+}
+
+static void color_to_rgb565_c(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  const uint16_t *palette = t->palette;
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 8; b++) {
+      *out++ = palette[pixels & 0xF];
+      pixels >>= 4;
+    }
+  }
+}
+
+static void mono_to_index8_c(uint8_t *out, const uint32_t *in, int words) {
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 32; b++) {
+      *out++ = pixels & 1;
+      pixels >>= 1;
+    }
+  }
+}
+
+static void color_to_index8_c(uint8_t *out, const uint32_t *in, int words) {
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 8; b++) {
+      *out++ = pixels & 0xF;
+      pixels >>= 4;
+    }
+  }
+}
+
+void fb_build_table(struct FB_Table *t, const uint32_t *colors, int count) {
+  memset(t->palette, 0, sizeof(t->palette));
+  memcpy(t->palette, colors, count * sizeof(uint32_t));
+  for (int b = 0; b < 256; b++) {
+    for (int k = 0; k < 8; k++) {
+      t->mono[b][k] = t->palette[(b >> k) & 1];
+    }
+    t->color[b][0] = t->palette[b & 0xF];
+    t->color[b][1] = t->palette[b >> 4];
+  }
+}
+
+void fb_build_table16(struct FB_Table16 *t, const uint16_t *colors, int count) {
+  memset(t->palette, 0, sizeof(t->palette));
+  memcpy(t->palette, colors, count * sizeof(uint16_t));
+  for (int b = 0; b < 256; b++) {
+    for (int k = 0; k < 8; k++) {
+      t->mono[b][k] = t->palette[(b >> k) & 1];
+    }
+    t->color[b][0] = t->palette[b & 0xF];
+    t->color[b][1] = t->palette[b >> 4];
+  }
+}
+
+static void mono_to_argb_table(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 4; b++) {
+      memcpy(out, t->mono[pixels & 0xFF], sizeof(t->mono[0]));
+      pixels >>= 8;
+      out += 8;
+    }
+  }
+}
+
+static void color_to_argb_table(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 4; b++) {
+      memcpy(out, t->color[pixels & 0xFF], sizeof(t->color[0]));
+      pixels >>= 8;
+      out += 2;
+    }
+  }
+}
+
+static void mono_to_rgb565_table(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 4; b++) {
+      memcpy(out, t->mono[pixels & 0xFF], sizeof(t->mono[0]));
+      pixels >>= 8;
+      out += 8;
+    }
+  }
+}
+
+static void color_to_rgb565_table(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 4; b++) {
+      memcpy(out, t->color[pixels & 0xFF], sizeof(t->color[0]));
+      pixels >>= 8;
+      out += 2;
+    }
+  }
+}
+
+#if FB_X86
+
+static void mono_to_argb_sse2(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  const uint32_t zero = t->palette[0], one = t->palette[1];
+  const __m128i z = _mm_set1_epi32((int)zero);
+  const __m128i d = _mm_set1_epi32((int)(zero ^ one));
+  const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+  for (int i = 0; i < words; i++) {
+    __m128i v = _mm_set1_epi32((int)in[i]);
+    for (int k = 0; k < 8; k++) {
+      __m128i m = _mm_cmpeq_epi32(_mm_and_si128(v, bits), bits);
+      _mm_storeu_si128((__m128i *)out, _mm_xor_si128(z, _mm_and_si128(m, d)));
+      v = _mm_srli_epi32(v, 4);
+      out += 4;
+    }
+  }
+}
+
+static void mono_to_rgb565_sse2(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  const uint16_t zero = t->palette[0], one = t->palette[1];
+  const __m128i z = _mm_set1_epi16((short)zero);
+  const __m128i d = _mm_set1_epi16((short)(zero ^ one));
+  const __m128i bits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+  for (int i = 0; i < words; i++) {
+    __m128i v = _mm_set1_epi16((short)in[i]);
+    __m128i w = _mm_set1_epi16((short)(in[i] >> 16));
+    __m128i m0 = _mm_cmpeq_epi16(_mm_and_si128(v, bits), bits);
+    __m128i m1 = _mm_cmpeq_epi16(_mm_and_si128(_mm_srli_epi16(v, 8), bits), bits);
+    __m128i m2 = _mm_cmpeq_epi16(_mm_and_si128(w, bits), bits);
+    __m128i m3 = _mm_cmpeq_epi16(_mm_and_si128(_mm_srli_epi16(w, 8), bits), bits);
+    _mm_storeu_si128((__m128i *)out + 0, _mm_xor_si128(z, _mm_and_si128(m0, d)));
+    _mm_storeu_si128((__m128i *)out + 1, _mm_xor_si128(z, _mm_and_si128(m1, d)));
+    _mm_storeu_si128((__m128i *)out + 2, _mm_xor_si128(z, _mm_and_si128(m2, d)));
+    _mm_storeu_si128((__m128i *)out + 3, _mm_xor_si128(z, _mm_and_si128(m3, d)));
+    out += 32;
+  }
+}
+
+static __m128i nibble_indices(const uint32_t *in) {
+  // Two words hold 16 pixels, two to a byte, the left one in the low nibble.
+  const __m128i low = _mm_set1_epi8(0x0F);
+  __m128i bytes = _mm_loadl_epi64((const __m128i *)in);
+  __m128i lo = _mm_and_si128(bytes, low);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), low);
+  return _mm_unpacklo_epi8(lo, hi);
+}
+
+static void mono_to_index8_sse2(uint8_t *out, const uint32_t *in, int words) {
+  const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+  const __m128i one = _mm_set1_epi8(1);
+  for (int i = 0; i < words; i++) {
+    // Spread each byte of the word over eight lanes.
+    __m128i v = _mm_cvtsi32_si128((int)in[i]);
+    v = _mm_unpacklo_epi8(v, v);
+    v = _mm_unpacklo_epi16(v, v);
+    __m128i lo = _mm_unpacklo_epi32(v, v);
+    __m128i hi = _mm_unpackhi_epi32(v, v);
+    lo = _mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits);
+    hi = _mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits);
+    _mm_storeu_si128((__m128i *)out + 0, _mm_and_si128(lo, one));
+    _mm_storeu_si128((__m128i *)out + 1, _mm_and_si128(hi, one));
+    out += 32;
+  }
+}
+
+static void color_to_index8_sse2(uint8_t *out, const uint32_t *in, int words) {
+  int i = 0;
+  for (; i + 2 <= words; i += 2) {
+    _mm_storeu_si128((__m128i *)out, nibble_indices(in + i));
+    out += 16;
+  }
+  color_to_index8_c(out, in + i, words - i);
+}
+
+// Splits byte n of each palette entry into its own table for PSHUFB.
+static __m128i palette_plane(const uint8_t *palette, int entry_size, int n) {
+  uint8_t plane[16];
+  for (int i = 0; i < 16; i++) {
+    plane[i] = palette[i * entry_size + n];
+  }
+  return _mm_loadu_si128((const __m128i *)plane);
+}
+
+__attribute__((target("ssse3")))
+static void color_to_argb_ssse3(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  const uint32_t *palette = t->palette;
+  const __m128i p0 = palette_plane((const uint8_t *)palette, 4, 0);
+  const __m128i p1 = palette_plane((const uint8_t *)palette, 4, 1);
+  const __m128i p2 = palette_plane((const uint8_t *)palette, 4, 2);
+  const __m128i p3 = palette_plane((const uint8_t *)palette, 4, 3);
+  int i = 0;
+  for (; i + 2 <= words; i += 2) {
+    __m128i idx = nibble_indices(in + i);
+    __m128i b0 = _mm_shuffle_epi8(p0, idx);
+    __m128i b1 = _mm_shuffle_epi8(p1, idx);
+    __m128i b2 = _mm_shuffle_epi8(p2, idx);
+    __m128i b3 = _mm_shuffle_epi8(p3, idx);
+    __m128i lo01 = _mm_unpacklo_epi8(b0, b1), hi01 = _mm_unpackhi_epi8(b0, b1);
+    __m128i lo23 = _mm_unpacklo_epi8(b2, b3), hi23 = _mm_unpackhi_epi8(b2, b3);
+    _mm_storeu_si128((__m128i *)out + 0, _mm_unpacklo_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i *)out + 1, _mm_unpackhi_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i *)out + 2, _mm_unpacklo_epi16(hi01, hi23));
+    _mm_storeu_si128((__m128i *)out + 3, _mm_unpackhi_epi16(hi01, hi23));
+    out += 16;
+  }
+  color_to_argb_c(out, in + i, words - i, t);
+}
+
+__attribute__((target("ssse3")))
+static void color_to_rgb565_ssse3(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  const uint16_t *palette = t->palette;
+  const __m128i p0 = palette_plane((const uint8_t *)palette, 2, 0);
+  const __m128i p1 = palette_plane((const uint8_t *)palette, 2, 1);
+  int i = 0;
+  for (; i + 2 <= words; i += 2) {
+    __m128i idx = nibble_indices(in + i);
+    __m128i b0 = _mm_shuffle_epi8(p0, idx);
+    __m128i b1 = _mm_shuffle_epi8(p1, idx);
+    _mm_storeu_si128((__m128i *)out + 0, _mm_unpacklo_epi8(b0, b1));
+    _mm_storeu_si128((__m128i *)out + 1, _mm_unpackhi_epi8(b0, b1));
+    out += 16;
+  }
+  color_to_rgb565_c(out, in + i, words - i, t);
+}
+
+__attribute__((target("avx2")))
+static void mono_to_argb_avx2(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  const uint32_t zero = t->palette[0], one = t->palette[1];
+  const __m256i z = _mm256_set1_epi32((int)zero);
+  const __m256i d = _mm256_set1_epi32((int)(zero ^ one));
+  const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  for (int i = 0; i < words; i++) {
+    __m256i v = _mm256_set1_epi32((int)in[i]);
+    for (int k = 0; k < 4; k++) {
+      __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(v, bits), bits);
+      _mm256_storeu_si256((__m256i *)out, _mm256_xor_si256(z, _mm256_and_si256(m, d)));
+      v = _mm256_srli_epi32(v, 8);
+      out += 8;
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void mono_to_rgb565_avx2(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  const uint16_t zero = t->palette[0], one = t->palette[1];
+  const __m256i z = _mm256_set1_epi16((short)zero);
+  const __m256i d = _mm256_set1_epi16((short)(zero ^ one));
+  const __m256i bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048,
+                                         4096, 8192, 16384, (short)32768);
+  for (int i = 0; i < words; i++) {
+    __m256i v = _mm256_set1_epi16((short)in[i]);
+    __m256i w = _mm256_set1_epi16((short)(in[i] >> 16));
+    __m256i m0 = _mm256_cmpeq_epi16(_mm256_and_si256(v, bits), bits);
+    __m256i m1 = _mm256_cmpeq_epi16(_mm256_and_si256(w, bits), bits);
+    _mm256_storeu_si256((__m256i *)out + 0, _mm256_xor_si256(z, _mm256_and_si256(m0, d)));
+    _mm256_storeu_si256((__m256i *)out + 1, _mm256_xor_si256(z, _mm256_and_si256(m1, d)));
+    out += 32;
+  }
+}
+
+#endif  // FB_X86
+
+#if FB_NEON
+
+static void mono_to_argb_neon(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  const uint32_t zero = t->palette[0], one = t->palette[1];
+  static const uint32_t bit_values[4] = { 1, 2, 4, 8 };
+  const uint32x4_t bits = vld1q_u32(bit_values);
+  const uint32x4_t z = vdupq_n_u32(zero), o = vdupq_n_u32(one);
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int k = 0; k < 8; k++) {
+      uint32x4_t m = vtstq_u32(vdupq_n_u32(pixels), bits);
+      vst1q_u32(out, vbslq_u32(m, o, z));
+      pixels >>= 4;
+      out += 4;
+    }
+  }
+}
+
+static void mono_to_rgb565_neon(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  const uint16_t zero = t->palette[0], one = t->palette[1];
+  static const uint16_t bit_values[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+  const uint16x8_t bits = vld1q_u16(bit_values);
+  const uint16x8_t z = vdupq_n_u16(zero), o = vdupq_n_u16(one);
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int k = 0; k < 4; k++) {
+      uint16x8_t m = vtstq_u16(vdupq_n_u16((uint16_t)(pixels & 0xFF)), bits);
+      vst1q_u16(out, vbslq_u16(m, o, z));
+      pixels >>= 8;
+      out += 8;
+    }
+  }
+}
+
+// The eight pixels of a word, one per byte, the leftmost first.
+static uint8x8_t nibbles(uint32_t word) {
+  uint8x8_t bytes = vreinterpret_u8_u32(vdup_n_u32(word));
+  return vzip_u8(vand_u8(bytes, vdup_n_u8(0x0F)), vshr_n_u8(bytes, 4)).val[0];
+}
+
+// Tables for VTBL hold byte n of each palette entry; VLD4 and VLD2
+// split the entries up that way, eight at a time.
+static void color_to_argb_neon(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  const uint32_t *palette = t->palette;
+  uint8x8x4_t lo = vld4_u8((const uint8_t *)palette);
+  uint8x8x4_t hi = vld4_u8((const uint8_t *)(palette + 8));
+  uint8x8x2_t t0 = { { lo.val[0], hi.val[0] } };
+  uint8x8x2_t t1 = { { lo.val[1], hi.val[1] } };
+  uint8x8x2_t t2 = { { lo.val[2], hi.val[2] } };
+  uint8x8x2_t t3 = { { lo.val[3], hi.val[3] } };
+  for (int i = 0; i < words; i++) {
+    uint8x8_t idx = nibbles(in[i]);
+    uint8x8x4_t px = { { vtbl2_u8(t0, idx), vtbl2_u8(t1, idx), vtbl2_u8(t2, idx), vtbl2_u8(t3, idx) } };
+    vst4_u8((uint8_t *)out, px);
+    out += 8;
+  }
+}
+
+static void color_to_rgb565_neon(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  const uint16_t *palette = t->palette;
+  uint8x8x2_t lo = vld2_u8((const uint8_t *)palette);
+  uint8x8x2_t hi = vld2_u8((const uint8_t *)(palette + 8));
+  uint8x8x2_t t0 = { { lo.val[0], hi.val[0] } };
+  uint8x8x2_t t1 = { { lo.val[1], hi.val[1] } };
+  for (int i = 0; i < words; i++) {
+    uint8x8_t idx = nibbles(in[i]);
+    uint8x8x2_t px = { { vtbl2_u8(t0, idx), vtbl2_u8(t1, idx) } };
+    vst2_u8((uint8_t *)out, px);
+    out += 8;
+  }
+}
+
+#endif  // FB_NEON
+
+static void (*mono_to_argb)(uint32_t *, const uint32_t *, int, const struct FB_Table *);
+static void (*color_to_argb)(uint32_t *, const uint32_t *, int, const struct FB_Table *);
+static void (*mono_to_rgb565)(uint16_t *, const uint32_t *, int, const struct FB_Table16 *);
+static void (*color_to_rgb565)(uint16_t *, const uint32_t *, int, const struct FB_Table16 *);
+static void (*mono_to_index8)(uint8_t *, const uint32_t *, int);
+static void (*color_to_index8)(uint8_t *, const uint32_t *, int);
+
+void fb_select(enum FB_Impl impl) {
+  mono_to_argb = mono_to_argb_c;
+  color_to_argb = color_to_argb_c;
+  mono_to_rgb565 = mono_to_rgb565_c;
+  color_to_rgb565 = color_to_rgb565_c;
+  mono_to_index8 = mono_to_index8_c;
+  color_to_index8 = color_to_index8_c;
+  if (impl == FB_LOOPS) {
+    return;
+  }
+  mono_to_argb = mono_to_argb_table;
+  color_to_argb = color_to_argb_table;
+  mono_to_rgb565 = mono_to_rgb565_table;
+  color_to_rgb565 = color_to_rgb565_table;
+  if (impl == FB_TABLES) {
+    return;
+  }
+#if FB_X86
+  mono_to_argb = mono_to_argb_sse2;
+  mono_to_rgb565 = mono_to_rgb565_sse2;
+  mono_to_index8 = mono_to_index8_sse2;
+  color_to_index8 = color_to_index8_sse2;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    color_to_argb = color_to_argb_ssse3;
+    color_to_rgb565 = color_to_rgb565_ssse3;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    mono_to_argb = mono_to_argb_avx2;
+    mono_to_rgb565 = mono_to_rgb565_avx2;
+  }
+#endif
+#if FB_NEON
+  mono_to_argb = mono_to_argb_neon;
+  color_to_argb = color_to_argb_neon;
+  mono_to_rgb565 = mono_to_rgb565_neon;
+  color_to_rgb565 = color_to_rgb565_neon;
+#endif
+}
+
+void fb_mono_to_argb(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  if (!mono_to_argb) {
+    fb_select(FB_BEST);
+  }
+  mono_to_argb(out, in, words, t);
+}
+
+void fb_color_to_argb(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t) {
+  if (!color_to_argb) {
+    fb_select(FB_BEST);
+  }
+  color_to_argb(out, in, words, t);
+}
+
+void fb_mono_to_rgb565(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  if (!mono_to_rgb565) {
+    fb_select(FB_BEST);
+  }
+  mono_to_rgb565(out, in, words, t);
+}
+
+void fb_color_to_rgb565(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t) {
+  if (!color_to_rgb565) {
+    fb_select(FB_BEST);
+  }
+  color_to_rgb565(out, in, words, t);
+}
+
+void fb_mono_to_index8(uint8_t *out, const uint32_t *in, int words) {
+  if (!mono_to_index8) {
+    fb_select(FB_BEST);
+  }
+  mono_to_index8(out, in, words);
+}
+
+void fb_color_to_index8(uint8_t *out, const uint32_t *in, int words) {
+  if (!color_to_index8) {
+    fb_select(FB_BEST);
+  }
+  color_to_index8(out, in, words);
+}
@@ -0,0 +1,48 @@
+#ifndef FB_CONVERT_H
+#define FB_CONVERT_H
+
+#include <stdint.h>
+
+// Host pixels for every byte of framebuffer memory: eight pixels in
+// 1 bpp mode, two in 4 bpp mode. Rebuild a table when its colours
+// change; that is cheap enough to do once per palette write, not per
+// frame.
+struct FB_Table {
+  uint32_t palette[16];
+  uint32_t mono[256][8];
+  uint32_t color[256][2];
+};
+
+struct FB_Table16 {
+  uint16_t palette[16];
+  uint16_t mono[256][8];
+  uint16_t color[256][2];
+};
+
+// Takes count (at most 16) colours; the rest are black. In 1 bpp mode
+// colours[0] is used for clear bits and colours[1] for set ones.
+void fb_build_table(struct FB_Table *t, const uint32_t *colors, int count);
+void fb_build_table16(struct FB_Table16 *t, const uint16_t *colors, int count);
+
+// Expand words of framebuffer memory into host pixels, leftmost pixel
+// first. In 1 bpp mode bit 0 of each word is the leftmost pixel; in
+// 4 bpp mode the lowest nibble is the leftmost pixel and indexes the
+// palette. The index8 variants store the pixel values themselves, one
+// byte each, for a colour-mapped display.
+
+void fb_mono_to_argb(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t);
+void fb_color_to_argb(uint32_t *out, const uint32_t *in, int words, const struct FB_Table *t);
+
+void fb_mono_to_rgb565(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t);
+void fb_color_to_rgb565(uint16_t *out, const uint32_t *in, int words, const struct FB_Table16 *t);
+
+void fb_mono_to_index8(uint8_t *out, const uint32_t *in, int words);
+void fb_color_to_index8(uint8_t *out, const uint32_t *in, int words);
+
+// Which implementation the functions above use. FB_BEST, the default,
+// is the fastest the host supports; the others are there for fb-bench.
+enum FB_Impl { FB_LOOPS, FB_TABLES, FB_BEST };
+
+void fb_select(enum FB_Impl impl);
+
+#endif  // FB_CONVERT_H
@@ -0,0 +1,160 @@
+#ifndef RISC_INTERNAL_H
+#define RISC_INTERNAL_H
+
+// CPU state and instruction encodings shared between the interpreter
+// and the x86-64 translator. Not part of the public API.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "risc.h"
+
+// Our memory layout is slightly different from the FPGA implementation:
+// The FPGA uses a 20-bit address bus and thus ignores the top 12 bits,
+// while we use all 32 bits. This allows us to have more than 1 megabyte
+// of RAM and/or a 16 color framebuffer.
+//
+// In the default configuration, the emulator is compatible with the
+// FPGA system. But If the user requests more memory, we move the
+// framebuffer to make room for a larger Oberon heap. This requires a
+// custom Display.Mod.
+
+
+#define DefaultMemSize      0x00100000
+#define DefaultDisplayStart 0x000E7F00
+
+#define ROMStart     0xFFFFF800
+#define ROMWords     512
+#define IOStart      0xFFFFFFC0
+#define PaletteStart 0xFFFFFF80
+
+// Read from the disk DMA port (IOStart+36) when there is one, so the
+// guest can tell it apart from hardware where that address reads 0.
+#define DiskDMAMagic 0x54434553  // "SECT"
+
+// risc_run stops once an idle loop has come back to one of its (at most
+// PollSites) polling instructions IdlePolls times.
+#define PollSites 4
+#define IdlePolls 20
+
+// The memory map covers the whole address space in 4 KB pages.
+#define PageShift 12
+#define PageSize  (1u << PageShift)
+#define PageCount (1u << (32 - PageShift))
+
+// Framebuffer damage is tracked in tiles of TileWidth x TileHeight pixels.
+#define TileWidth  32
+#define TileHeight 16
+
+
+// An instruction word with its fields already extracted. Each word of
+// RAM and ROM has one of these next to it; the entry is filled in the
+// first time the word is executed and cleared again when it is written.
+struct Decoded {
+  uint8_t kind;
+  uint8_t a, b, c;
+  uint32_t imm;
+};
+
+struct RISC {
+  uint32_t PC;
+  uint32_t R[16];
+  uint32_t H;
+
+  // Condition flags, evaluated lazily: Z and N follow the last value
+  // written to a register, C and V the operands of the last ADD or SUB.
+  uint32_t flag_value;
+  uint32_t flag_b, flag_c;
+  bool     flag_sub;
+
+  uint32_t mem_size;
+  uint32_t display_start;
+
+  uint32_t progress;
+  uint32_t poll_pc[PollSites];
+  int      poll_sites;
+  bool     poll_timer;
+  bool     serial_ready;
+  uint32_t current_tick;
+  uint32_t mouse;
+  uint8_t  key_buf[16];
+  uint32_t key_cnt;
+  uint32_t switches;
+
+  const struct RISC_LED *leds;
+  const struct RISC_Serial *serial;
+  uint32_t spi_selected;
+  bool     spi_fast;
+  const struct RISC_SPI *spi[4];
+  const struct RISC_Clipboard *clipboard;
+  const struct RISC_HostFS *hostfs;
+  const struct RISC_DiskDMA *disk_dma;
+
+  bool fb_color;
+  int fb_width;   // words
+  int fb_height;  // lines
+  // One bit per tile, set when the tile is written. Each row of tiles
+  // takes tile_stride words; tile_words is the width of a tile in words.
+  uint32_t *damage_map;
+  int tile_words, tile_cols, tile_rows, tile_stride;
+
+  uint32_t *RAM;
+  uint32_t ROM[ROMWords];
+
+  // For each page, the RAM behind it if loads or stores may go straight
+  // to host memory, otherwise NULL. Stores to the framebuffer, MMIO,
+  // partial pages and pages holding translated code take the slow path.
+  uint32_t **load_map;
+  uint32_t **store_map;
+  uint32_t Palette[16];
+  uint32_t palette_generation;  // counts writes to Palette
+
+  struct Decoded *RAM_decoded;
+  struct Decoded ROM_decoded[ROMWords];
+
+  // Set while the translator is active; jit_code_map has one byte per
+  // word of RAM, nonzero if the word is part of a translated block.
+  struct RISC_JIT *jit;
+  const uint8_t *jit_code_map;
+
+  // Set while the profiler is active; a sample is taken every
+  // profile_interval instructions.
+  struct RISC_Profile *profile;
+  int profile_interval, profile_countdown;
+};
+
+enum {
+  MOV, LSL, ASR, ROR,
+  AND, ANN, IOR, XOR,
+  ADD, SUB, MUL, DIV,
+  FAD, FSB, FML, FDV,
+};
+
+// Handler index of a decoded instruction. Register instructions come in
+// two flavours, the second operand being R[c] or the immediate in imm.
+// Branches keep the condition in b, the link flag in a and the
+// displacement in imm. Anything unusual (the u/v variants of the
+// register instructions, floating point, division) is left as GENERIC
+// with the raw word in imm and goes through risc_execute.
+enum {
+  UNDECODED,
+  VOID,
+  GENERIC,
+  MOV_R, LSL_R, ASR_R, ROR_R, AND_R, ANN_R, IOR_R, XOR_R, ADD_R, SUB_R, MUL_R,
+  MOV_I, LSL_I, ASR_I, ROR_I, AND_I, ANN_I, IOR_I, XOR_I, ADD_I, SUB_I, MUL_I,
+  LDW, LDB, STW, STB,
+  BR_R, BR_I,
+  // Superinstructions, see risc_fuse.
+  MOV_IOR, LDW_ADD_STW, SUB_R_BR, SUB_I_BR,
+};
+
+struct Decoded risc_decode(uint32_t ir);
+void risc_map_memory(struct RISC *risc);
+
+// Out-of-line memory accessors, called from translated code when the
+// inline fast path does not apply (MMIO, framebuffer, translated code).
+uint32_t risc_mem_load_word(struct RISC *risc, uint32_t address);
+uint32_t risc_mem_load_byte(struct RISC *risc, uint32_t address);
+void risc_mem_store_word(struct RISC *risc, uint32_t address, uint32_t value);
+void risc_mem_store_byte(struct RISC *risc, uint32_t address, uint32_t value);
+
+#endif  // RISC_INTERNAL_H
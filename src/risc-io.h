@@ -1,6 +1,7 @@
 #ifndef RISC_IO_H
 #define RISC_IO_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 struct RISC_Serial {
@@ -10,8 +11,11 @@ struct RISC_Serial {
 };
 
 struct RISC_SPI {
+  // Returns what the device sent during the last transfer.
   uint32_t (*read_data)(const struct RISC_SPI *);
-  void (*write_data)(const struct RISC_SPI *, uint32_t);
+  // Transfers the low byte of the value or, in fast mode, all four
+  // bytes, lowest first.
+  void (*write_data)(const struct RISC_SPI *, uint32_t, bool fast);
 };
 
 struct RISC_Clipboard {
@@ -29,4 +33,11 @@ struct RISC_HostFS {
   void (*write)(const struct RISC_HostFS *, uint32_t, uint32_t *);
 };
 
+// Moves count 512-byte blocks of the SD card, starting at block, to or
+// from RAM in one go. Returns false if the blocks can't be transferred.
+struct RISC_DiskDMA {
+  bool (*read)(const struct RISC_DiskDMA *, uint32_t block, uint32_t count, uint32_t *dst);
+  bool (*write)(const struct RISC_DiskDMA *, uint32_t block, uint32_t count, const uint32_t *src);
+};
+
 #endif  // RISC_IO_H
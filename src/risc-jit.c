@@ -0,0 +1,830 @@
+// Translates RISC5 code in RAM into x86-64 code, one basic block at a
+// time.
+//
+// A block runs up to and including the next branch, or up to the first
+// instruction we don't translate (division, floating point, the u/v
+// register variants), which is left to the interpreter. The register
+// file and the flags stay in struct RISC. Loads and stores that hit MMIO,
+// the framebuffer or translated code call back into risc.c.
+//
+// Register use in translated code:
+//   rbx   struct RISC *
+//   r12   risc->RAM
+//   r13   jit->code_map
+//   r14d  instructions retired so far
+//   r15d  instruction budget
+//
+// A block exits by storing the next PC and jumping to the epilogue,
+// which hands its count back to risc_jit_run. Exits to a known PC are
+// chained: once the target has been translated, the exit jumps straight
+// to it instead.
+
+#define _DEFAULT_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "risc-internal.h"
+#include "risc-jit.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define CodeSize     (32 << 20)
+#define BlockReserve (64 << 10)  // more than the code for any one block
+#define MaxBlockLen  64
+#define MaxIOHits    32          // MMIO accesses before a block is interpreted
+#define WordPageShift (PageShift - 2)  // memory map pages, in words
+#define ArenaSize    (1 << 20)
+
+// Translated stores clear the decode cache entry of the word they write
+// with a single byte store.
+typedef char decoded_layout_check[sizeof(struct Decoded) == 8 && UNDECODED == 0 ? 1 : -1];
+
+// A chainable exit.
+struct Link {
+  uint8_t *site;      // rel32 of the exit jump
+  uint8_t *tail;      // where that jump goes while unchained
+  uint32_t target;    // PC of the block it leads to
+  struct Link *next;  // next link chained to the same block
+};
+
+struct Block {
+  uint32_t pc, len;
+  uint8_t *entry;
+  uint32_t io_hits;
+  bool interpret;  // too much MMIO, leave it to the interpreter
+  bool dead;
+  struct Link *incoming;
+};
+
+struct PageEntry {
+  struct Block *block;
+  struct PageEntry *next;
+};
+
+// Blocks, links and page entries live until the next flush.
+struct Arena {
+  struct Arena *prev;
+  size_t used;
+  char data[];
+};
+
+struct RISC_JIT {
+  struct RISC *risc;
+  uint8_t *code, *code_start, *p;
+  int (*enter)(struct RISC *risc, uint8_t *entry, int budget);
+  uint8_t *epilogue;
+  struct Link *last_link;  // written by the epilogue
+
+  uint32_t words;          // RAM words, including the framebuffer
+  uint32_t code_words;     // words below the framebuffer
+  struct Block **map;      // block starting at each word
+  uint8_t *code_map;       // nonzero if the word is part of a block
+  struct PageEntry **pages;
+  uint32_t generation;     // bumped whenever a block goes away
+  struct Arena *arena;
+};
+
+// Per-instruction slow path, emitted after the block body.
+struct Cold {
+  uint8_t *from[2];  // rel32s jumping to it
+  int nfrom;
+  uint8_t *resume;
+  uint32_t k;        // index in the block
+  int zn;            // register Z and N come from if it exits, or -1
+};
+
+enum { EAX = 0, ECX = 1, EDX = 2, ESI = 6, EDI = 7 };
+
+#define OFF(field) offsetof(struct RISC, field)
+#define REG(r)     (OFF(R) + 4 * (size_t)(r))
+
+#define EMIT(...) emit_bytes(jit, (const uint8_t[]){ __VA_ARGS__ }, \
+                             sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+
+static void *arena_alloc(struct RISC_JIT *jit, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (!jit->arena || jit->arena->used + size > ArenaSize) {
+    struct Arena *a = malloc(sizeof(struct Arena) + ArenaSize);
+    a->prev = jit->arena;
+    a->used = 0;
+    jit->arena = a;
+  }
+  void *ptr = jit->arena->data + jit->arena->used;
+  jit->arena->used += size;
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+static void arena_free(struct RISC_JIT *jit) {
+  while (jit->arena) {
+    struct Arena *prev = jit->arena->prev;
+    free(jit->arena);
+    jit->arena = prev;
+  }
+}
+
+
+static void emit_bytes(struct RISC_JIT *jit, const uint8_t *bytes, size_t n) {
+  memcpy(jit->p, bytes, n);
+  jit->p += n;
+}
+
+static void emit8(struct RISC_JIT *jit, uint32_t b) {
+  *jit->p++ = (uint8_t)b;
+}
+
+static void emit32(struct RISC_JIT *jit, uint32_t v) {
+  memcpy(jit->p, &v, 4);
+  jit->p += 4;
+}
+
+static void emit64(struct RISC_JIT *jit, uint64_t v) {
+  memcpy(jit->p, &v, 8);
+  jit->p += 8;
+}
+
+static void patch(uint8_t *site, uint8_t *target) {
+  int32_t rel = (int32_t)(target - (site + 4));
+  memcpy(site, &rel, 4);
+}
+
+// ModRM and displacement for [rbx + disp].
+static void emit_mem(struct RISC_JIT *jit, uint32_t reg, size_t disp) {
+  emit8(jit, 0x83 | reg << 3);
+  emit32(jit, (uint32_t)disp);
+}
+
+static void load_reg(struct RISC_JIT *jit, uint32_t x86, int r) {
+  emit8(jit, 0x8B);
+  emit_mem(jit, x86, REG(r));
+}
+
+static void store_reg(struct RISC_JIT *jit, uint32_t x86, int r) {
+  emit8(jit, 0x89);
+  emit_mem(jit, x86, REG(r));
+}
+
+static void store_imm(struct RISC_JIT *jit, size_t disp, uint32_t imm) {
+  emit8(jit, 0xC7);
+  emit_mem(jit, 0, disp);
+  emit32(jit, imm);
+}
+
+static void store_imm8(struct RISC_JIT *jit, size_t disp, uint32_t imm) {
+  emit8(jit, 0xC6);
+  emit_mem(jit, 0, disp);
+  emit8(jit, imm);
+}
+
+// eax = eax <op> imm, op being the /digit of opcode 0x81.
+static void alu_imm(struct RISC_JIT *jit, uint32_t op, uint32_t imm) {
+  emit8(jit, 0x81);
+  emit8(jit, 0xC0 | op << 3);
+  emit32(jit, imm);
+}
+
+// Sets an 8-bit register from a condition code.
+static void emit_setcc(struct RISC_JIT *jit, uint32_t setcc, uint32_t reg) {
+  emit8(jit, 0x0F);
+  emit8(jit, setcc);
+  emit8(jit, 0xC0 | reg);
+}
+
+static uint8_t *emit_jcc(struct RISC_JIT *jit, uint32_t jcc) {
+  emit8(jit, 0x0F);
+  emit8(jit, jcc);
+  emit32(jit, 0);
+  return jit->p - 4;
+}
+
+static void emit_jmp(struct RISC_JIT *jit, uint8_t *target) {
+  emit8(jit, 0xE9);
+  emit32(jit, 0);
+  patch(jit->p - 4, target);
+}
+
+static void emit_call(struct RISC_JIT *jit, uint64_t fn) {
+  EMIT(0x48, 0xB8);  // mov rax, fn
+  emit64(jit, fn);
+  EMIT(0xFF, 0xD0);  // call rax
+}
+
+// Brings Z and N up to date from the last register written.
+static void emit_zn(struct RISC_JIT *jit, int zn) {
+  if (zn >= 0) {
+    load_reg(jit, EAX, zn);
+    EMIT(0x89);  // mov [flag_value], eax
+    emit_mem(jit, EAX, OFF(flag_value));
+  }
+}
+
+// Records the operands of an ADD or SUB for C and V, the first one
+// being in eax. cv is the kind of the last ADD or SUB recorded in this
+// block, if any, which tells whether flag_sub is already right.
+static void emit_cv(struct RISC_JIT *jit, struct Decoded *d, int cv) {
+  bool sub = d->kind == SUB_R || d->kind == SUB_I;
+  EMIT(0x89);  // mov [flag_b], eax
+  emit_mem(jit, EAX, OFF(flag_b));
+  if (d->kind == ADD_R || d->kind == SUB_R) {
+    EMIT(0x89);  // mov [flag_c], ecx
+    emit_mem(jit, ECX, OFF(flag_c));
+  } else {
+    store_imm(jit, OFF(flag_c), d->imm);
+  }
+  if (cv != (sub ? SUB : ADD)) {
+    store_imm8(jit, OFF(flag_sub), sub);
+  }
+}
+
+// C and V only have to be recorded if they can be seen: at a branch,
+// the end of the block, or a load or store, which may leave the block
+// early. Not if another ADD or SUB comes first.
+static bool cv_needed(struct Decoded *insn, uint32_t len, uint32_t k) {
+  for (k++; k < len; k++) {
+    switch (insn[k].kind) {
+      case ADD_R: case SUB_R: case ADD_I: case SUB_I:
+        return false;
+      case LDW: case LDB: case STW: case STB: case BR_R: case BR_I:
+        return true;
+    }
+  }
+  return true;
+}
+
+// Leaves the branch condition, before inversion, in al.
+static void emit_condition(struct RISC_JIT *jit, uint32_t cond, int cv) {
+  if (cond >= 2 && cond <= 6) {
+    // Redo the last ADD or SUB to get C and V into CF and OF.
+    EMIT(0x8B);  // mov ecx, [flag_b]
+    emit_mem(jit, ECX, OFF(flag_b));
+    if (cv == ADD) {
+      EMIT(0x03);  // add ecx, [flag_c]
+      emit_mem(jit, ECX, OFF(flag_c));
+    } else if (cv == SUB) {
+      EMIT(0x3B);  // cmp ecx, [flag_c]
+      emit_mem(jit, ECX, OFF(flag_c));
+    } else {
+      EMIT(0x80);  // cmp byte [flag_sub], 0
+      emit_mem(jit, 7, OFF(flag_sub));
+      emit8(jit, 0);
+      uint8_t *sub = emit_jcc(jit, 0x85);  // jne
+      EMIT(0x03);  // add ecx, [flag_c]
+      emit_mem(jit, ECX, OFF(flag_c));
+      EMIT(0xE9, 0, 0, 0, 0);
+      uint8_t *done = jit->p - 4;
+      patch(sub, jit->p);
+      EMIT(0x3B);  // cmp ecx, [flag_c]
+      emit_mem(jit, ECX, OFF(flag_c));
+      patch(done, jit->p);
+    }
+    if (cond == 2 || cond == 4) {
+      emit_setcc(jit, 0x92, EAX);
+    } else {
+      emit_setcc(jit, 0x90, cond == 3 ? EAX : EDX);
+    }
+  }
+  if (cond == 0 || cond == 5 || cond == 6) {
+    EMIT(0x8B);  // mov eax, [flag_value]
+    emit_mem(jit, EAX, OFF(flag_value));
+    EMIT(0xC1, 0xE8, 0x1F);  // shr eax, 31
+    if (cond != 0) {
+      EMIT(0x30, 0xD0);  // xor al, dl
+    }
+  }
+  if (cond == 1 || cond == 4 || cond == 6) {
+    EMIT(0x83);  // cmp dword [flag_value], 0
+    emit_mem(jit, 7, OFF(flag_value));
+    emit8(jit, 0);
+    if (cond == 1) {
+      emit_setcc(jit, 0x94, EAX);
+    } else {
+      emit_setcc(jit, 0x94, ECX);
+      EMIT(0x08, 0xC8);  // or al, cl
+    }
+  }
+}
+
+static void emit_exit(struct RISC_JIT *jit, uint32_t count, uint32_t target, bool chainable) {
+  EMIT(0x41, 0x81, 0xC6);  // add r14d, count
+  emit32(jit, count);
+  struct Link *link = NULL;
+  if (chainable) {
+    link = arena_alloc(jit, sizeof(*link));
+    link->target = target;
+    EMIT(0xE9, 0, 0, 0, 0);
+    link->site = jit->p - 4;
+    link->tail = jit->p;
+  }
+  store_imm(jit, OFF(PC), target);
+  if (link) {
+    EMIT(0x48, 0xBA);  // mov rdx, link
+    emit64(jit, (uint64_t)(uintptr_t)link);
+  } else {
+    EMIT(0x31, 0xD2);  // xor edx, edx
+  }
+  emit_jmp(jit, jit->epilogue);
+}
+
+
+static void unchain(struct Block *b) {
+  for (struct Link *link = b->incoming; link; link = link->next) {
+    patch(link->site, link->tail);
+  }
+  b->incoming = NULL;
+}
+
+static void count_io(struct RISC_JIT *jit, struct Block *b) {
+  if (++b->io_hits > MaxIOHits && !b->interpret) {
+    b->interpret = true;
+    unchain(b);
+  }
+}
+
+static uint32_t slow_load_word(struct RISC *risc, uint32_t address, struct Block *b) {
+  if (address >= risc->mem_size) {
+    count_io(risc->jit, b);
+  }
+  return risc_mem_load_word(risc, address);
+}
+
+static uint32_t slow_load_byte(struct RISC *risc, uint32_t address, struct Block *b) {
+  if (address >= risc->mem_size) {
+    count_io(risc->jit, b);
+  }
+  return risc_mem_load_byte(risc, address);
+}
+
+// These return nonzero if the store threw away translations, in which
+// case the block must not continue.
+static int slow_store_word(struct RISC *risc, uint32_t address, uint32_t value, struct Block *b) {
+  struct RISC_JIT *jit = risc->jit;
+  uint32_t generation = jit->generation;
+  if (address >= risc->mem_size) {
+    count_io(jit, b);
+  }
+  risc_mem_store_word(risc, address, value);
+  return jit->generation != generation;
+}
+
+static int slow_store_byte(struct RISC *risc, uint32_t address, uint32_t value, struct Block *b) {
+  struct RISC_JIT *jit = risc->jit;
+  uint32_t generation = jit->generation;
+  if (address >= risc->mem_size) {
+    count_io(jit, b);
+  }
+  risc_mem_store_byte(risc, address, value);
+  return jit->generation != generation;
+}
+
+
+static bool translatable(uint8_t kind) {
+  return kind >= MOV_R && kind <= BR_I;
+}
+
+static void emit_memory(struct RISC_JIT *jit, struct Decoded *d, struct Cold *cold) {
+  load_reg(jit, EAX, d->b);
+  if (d->imm) {
+    emit8(jit, 0x05);  // add eax, imm
+    emit32(jit, d->imm);
+  }
+  if (d->kind == LDW || d->kind == LDB) {
+    EMIT(0x3B);  // cmp eax, [mem_size]
+    emit_mem(jit, EAX, OFF(mem_size));
+    cold->from[cold->nfrom++] = emit_jcc(jit, 0x83);  // jae
+    if (d->kind == LDW) {
+      EMIT(0x83, 0xE0, 0xFC,         // and eax, -4
+           0x41, 0x8B, 0x04, 0x04);  // mov eax, [r12 + rax]
+    } else {
+      EMIT(0x41, 0x0F, 0xB6, 0x04, 0x04);  // movzx eax, byte [r12 + rax]
+    }
+    store_reg(jit, EAX, d->a);
+  } else {
+    EMIT(0x3B);  // cmp eax, [display_start]
+    emit_mem(jit, EAX, OFF(display_start));
+    cold->from[cold->nfrom++] = emit_jcc(jit, 0x83);  // jae
+    EMIT(0x89, 0xC1,                          // mov ecx, eax
+         0xC1, 0xE9, 0x02,                    // shr ecx, 2
+         0x41, 0x80, 0x7C, 0x0D, 0x00, 0x00); // cmp byte [r13 + rcx], 0
+    cold->from[cold->nfrom++] = emit_jcc(jit, 0x85);  // jne
+    load_reg(jit, EDX, d->a);
+    if (d->kind == STW) {
+      EMIT(0x83, 0xE0, 0xFC,         // and eax, -4
+           0x41, 0x89, 0x14, 0x04);  // mov [r12 + rax], edx
+    } else {
+      EMIT(0x41, 0x88, 0x14, 0x04);  // mov [r12 + rax], dl
+    }
+    EMIT(0x48, 0x8B);  // mov rdx, [RAM_decoded]
+    emit_mem(jit, EDX, OFF(RAM_decoded));
+    EMIT(0xC6, 0x04, 0xCA, 0x00);  // mov byte [rdx + rcx*8], UNDECODED
+  }
+  cold->resume = jit->p;
+}
+
+static void emit_cold(struct RISC_JIT *jit, struct Block *b, struct Decoded *d, struct Cold *cold) {
+  for (int i = 0; i < cold->nfrom; i++) {
+    patch(cold->from[i], jit->p);
+  }
+  EMIT(0x89, 0xC6,         // mov esi, eax
+       0x48, 0x89, 0xDF);  // mov rdi, rbx
+  if (d->kind == LDW || d->kind == LDB) {
+    // The idle detection in risc_poll looks at PC.
+    store_imm(jit, OFF(PC), b->pc + cold->k + 1);
+    EMIT(0x48, 0xBA);  // mov rdx, b
+    emit64(jit, (uint64_t)(uintptr_t)b);
+    emit_call(jit, (uint64_t)(uintptr_t)(d->kind == LDW ? slow_load_word : slow_load_byte));
+    store_reg(jit, EAX, d->a);
+    EMIT(0x83);  // cmp dword [progress], 0
+    emit_mem(jit, 7, OFF(progress));
+    emit8(jit, 0);
+    patch(emit_jcc(jit, 0x85), cold->resume);  // jne
+  } else {
+    load_reg(jit, EDX, d->a);
+    EMIT(0x48, 0xB9);  // mov rcx, b
+    emit64(jit, (uint64_t)(uintptr_t)b);
+    emit_call(jit, (uint64_t)(uintptr_t)(d->kind == STW ? slow_store_word : slow_store_byte));
+    EMIT(0x85, 0xC0);  // test eax, eax
+    patch(emit_jcc(jit, 0x84), cold->resume);  // je
+  }
+  emit_zn(jit, cold->zn);
+  emit_exit(jit, cold->k + 1, b->pc + cold->k + 1, false);
+}
+
+static void emit_branch(struct RISC_JIT *jit, struct Block *b, struct Decoded *d, int cv) {
+  uint32_t next = b->pc + b->len;
+  uint32_t cond = d->b & 7;
+  bool inv = d->b >> 3;
+  uint8_t *not_taken = NULL;
+  if (cond == 7) {
+    if (inv) {
+      emit_exit(jit, b->len, next, true);
+      return;
+    }
+  } else {
+    emit_condition(jit, cond, cv);
+    EMIT(0x84, 0xC0);  // test al, al
+    not_taken = emit_jcc(jit, inv ? 0x85 : 0x84);
+  }
+  if (d->a) {
+    // The link value is a small positive number.
+    store_imm(jit, REG(15), next * 4);
+    store_imm(jit, OFF(flag_value), next * 4);
+  }
+  if (d->kind == BR_I) {
+    emit_exit(jit, b->len, next + d->imm, true);
+  } else {
+    load_reg(jit, EAX, d->c);
+    EMIT(0xC1, 0xE8, 0x02);  // shr eax, 2
+    EMIT(0x89);              // mov [PC], eax
+    emit_mem(jit, EAX, OFF(PC));
+    EMIT(0x41, 0x81, 0xC6);  // add r14d, len
+    emit32(jit, b->len);
+    EMIT(0x31, 0xD2);        // xor edx, edx
+    emit_jmp(jit, jit->epilogue);
+  }
+  if (not_taken) {
+    patch(not_taken, jit->p);
+    emit_exit(jit, b->len, next, true);
+  }
+}
+
+static void emit_block(struct RISC_JIT *jit, struct Block *b, struct Decoded *insn) {
+  struct Cold cold[MaxBlockLen];
+  int ncold = 0;
+  int zn = -1;  // register Z and N come from, if written in this block
+  int cv = -1;  // ADD or SUB, if this block recorded one for C and V
+
+  b->entry = jit->p;
+  EMIT(0x44, 0x89, 0xF8,  // mov eax, r15d
+       0x44, 0x29, 0xF0,  // sub eax, r14d
+       0x3D);             // cmp eax, len
+  emit32(jit, b->len);
+  uint8_t *over_budget = emit_jcc(jit, 0x8C);  // jl
+
+  for (uint32_t k = 0; k < b->len; k++) {
+    struct Decoded *d = &insn[k];
+    switch (d->kind) {
+      case MOV_R:
+        load_reg(jit, EAX, d->c);
+        break;
+      case MOV_I:
+        emit8(jit, 0xB8);  // mov eax, imm
+        emit32(jit, d->imm);
+        break;
+      case LSL_R: case ASR_R: case ROR_R: {
+        static const uint8_t modrm[] = { [LSL_R - LSL_R] = 0xE0, [ASR_R - LSL_R] = 0xF8, [ROR_R - LSL_R] = 0xC8 };
+        load_reg(jit, ECX, d->c);
+        load_reg(jit, EAX, d->b);
+        emit8(jit, 0xD3);  // shift eax, cl
+        emit8(jit, modrm[d->kind - LSL_R]);
+        break;
+      }
+      case LSL_I: case ASR_I: case ROR_I: {
+        static const uint8_t modrm[] = { [LSL_I - LSL_I] = 0xE0, [ASR_I - LSL_I] = 0xF8, [ROR_I - LSL_I] = 0xC8 };
+        load_reg(jit, EAX, d->b);
+        emit8(jit, 0xC1);  // shift eax, imm
+        emit8(jit, modrm[d->kind - LSL_I]);
+        emit8(jit, d->imm & 31);
+        break;
+      }
+      case AND_R: case IOR_R: case XOR_R: {
+        static const uint8_t opcode[] = {
+          [AND_R - AND_R] = 0x23, [IOR_R - AND_R] = 0x0B, [XOR_R - AND_R] = 0x33,
+        };
+        load_reg(jit, EAX, d->b);
+        emit8(jit, opcode[d->kind - AND_R]);
+        emit_mem(jit, EAX, REG(d->c));
+        break;
+      }
+      case ADD_R: case SUB_R:
+        load_reg(jit, EAX, d->b);
+        load_reg(jit, ECX, d->c);
+        if (cv_needed(insn, b->len, k)) {
+          emit_cv(jit, d, cv);
+          cv = d->kind == ADD_R ? ADD : SUB;
+        }
+        EMIT(d->kind == ADD_R ? 0x01 : 0x29, 0xC8);  // add/sub eax, ecx
+        break;
+      case ANN_R:
+        load_reg(jit, ECX, d->c);
+        load_reg(jit, EAX, d->b);
+        EMIT(0xF7, 0xD1,   // not ecx
+             0x21, 0xC8);  // and eax, ecx
+        break;
+      case AND_I: load_reg(jit, EAX, d->b); alu_imm(jit, 4, d->imm); break;
+      case ANN_I: load_reg(jit, EAX, d->b); alu_imm(jit, 4, ~d->imm); break;
+      case IOR_I: load_reg(jit, EAX, d->b); alu_imm(jit, 1, d->imm); break;
+      case XOR_I: load_reg(jit, EAX, d->b); alu_imm(jit, 6, d->imm); break;
+      case ADD_I: case SUB_I:
+        load_reg(jit, EAX, d->b);
+        if (cv_needed(insn, b->len, k)) {
+          emit_cv(jit, d, cv);
+          cv = d->kind == ADD_I ? ADD : SUB;
+        }
+        alu_imm(jit, d->kind == ADD_I ? 0 : 5, d->imm);
+        break;
+      case MUL_R:
+        load_reg(jit, EAX, d->b);
+        EMIT(0xF7);  // imul dword [R[c]]
+        emit_mem(jit, 5, REG(d->c));
+        break;
+      case MUL_I:
+        load_reg(jit, EAX, d->b);
+        emit8(jit, 0xB9);  // mov ecx, imm
+        emit32(jit, d->imm);
+        EMIT(0xF7, 0xE9);  // imul ecx
+        break;
+      case LDW: case LDB: case STW: case STB: {
+        struct Cold *c = &cold[ncold++];
+        c->nfrom = 0;
+        c->k = k;
+        c->zn = d->kind == LDW || d->kind == LDB ? d->a : zn;
+        emit_memory(jit, d, c);
+        if (d->kind == LDW || d->kind == LDB) {
+          zn = d->a;
+        }
+        continue;
+      }
+      case BR_R: case BR_I:
+        emit_zn(jit, zn);
+        emit_branch(jit, b, d, cv);
+        continue;
+    }
+    if (d->kind == MUL_R || d->kind == MUL_I) {
+      EMIT(0x89);  // mov [H], edx
+      emit_mem(jit, EDX, OFF(H));
+    }
+    store_reg(jit, EAX, d->a);
+    zn = d->a;
+  }
+
+  struct Decoded *last = &insn[b->len - 1];
+  if (last->kind != BR_R && last->kind != BR_I) {
+    emit_zn(jit, zn);
+    emit_exit(jit, b->len, b->pc + b->len, true);
+  }
+
+  patch(over_budget, jit->p);
+  store_imm(jit, OFF(PC), b->pc);
+  EMIT(0x31, 0xD2);  // xor edx, edx
+  emit_jmp(jit, jit->epilogue);
+
+  for (int i = 0; i < ncold; i++) {
+    emit_cold(jit, b, &insn[cold[i].k], &cold[i]);
+  }
+}
+
+static void emit_trampoline(struct RISC_JIT *jit) {
+  jit->enter = (int (*)(struct RISC *, uint8_t *, int))(uintptr_t)jit->p;
+  EMIT(0x53,                    // push rbx
+       0x41, 0x54,              // push r12
+       0x41, 0x55,              // push r13
+       0x41, 0x56,              // push r14
+       0x41, 0x57,              // push r15
+       0x48, 0x89, 0xFB,        // mov rbx, rdi
+       0x4C, 0x8B);             // mov r12, [RAM]
+  emit_mem(jit, 4, OFF(RAM));
+  EMIT(0x49, 0xBD);             // mov r13, code_map
+  emit64(jit, (uint64_t)(uintptr_t)jit->code_map);
+  EMIT(0x45, 0x31, 0xF6,        // xor r14d, r14d
+       0x41, 0x89, 0xD7,        // mov r15d, edx
+       0xFF, 0xE6);             // jmp rsi
+
+  jit->epilogue = jit->p;
+  EMIT(0x48, 0xB8);             // mov rax, &last_link
+  emit64(jit, (uint64_t)(uintptr_t)&jit->last_link);
+  EMIT(0x48, 0x89, 0x10,        // mov [rax], rdx
+       0x44, 0x89, 0xF0,        // mov eax, r14d
+       0x41, 0x5F,              // pop r15
+       0x41, 0x5E,              // pop r14
+       0x41, 0x5D,              // pop r13
+       0x41, 0x5C,              // pop r12
+       0x5B,                    // pop rbx
+       0xC3);                   // ret
+  jit->code_start = jit->p;
+}
+
+
+struct RISC_JIT *risc_jit_new(struct RISC *risc) {
+  void *code = mmap(NULL, CodeSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    perror("Can't allocate memory for the JIT");
+    return NULL;
+  }
+  struct RISC_JIT *jit = calloc(1, sizeof(*jit));
+  jit->risc = risc;
+  jit->code = jit->p = code;
+  jit->words = risc->mem_size / 4;
+  jit->code_words = risc->display_start / 4;
+  jit->map = calloc(jit->words, sizeof(*jit->map));
+  jit->code_map = calloc(jit->words, 1);
+  jit->pages = calloc((jit->words >> WordPageShift) + 1, sizeof(*jit->pages));
+  emit_trampoline(jit);
+  risc->jit_code_map = jit->code_map;
+  return jit;
+}
+
+void risc_jit_free(struct RISC_JIT *jit) {
+  arena_free(jit);
+  munmap(jit->code, CodeSize);
+  free(jit->map);
+  free(jit->code_map);
+  free(jit->pages);
+  free(jit);
+}
+
+void risc_jit_flush(struct RISC_JIT *jit) {
+  memset(jit->map, 0, jit->words * sizeof(*jit->map));
+  memset(jit->code_map, 0, jit->words);
+  memset(jit->pages, 0, ((jit->words >> WordPageShift) + 1) * sizeof(*jit->pages));
+  arena_free(jit);
+  jit->p = jit->code_start;
+  jit->last_link = NULL;
+  jit->generation++;
+  risc_map_memory(jit->risc);
+}
+
+static void add_to_page(struct RISC_JIT *jit, uint32_t page, struct Block *b) {
+  struct PageEntry *e = arena_alloc(jit, sizeof(*e));
+  e->block = b;
+  e->next = jit->pages[page];
+  jit->pages[page] = e;
+}
+
+static struct Block *translate(struct RISC_JIT *jit, struct RISC *risc, uint32_t pc) {
+  if (jit->code + CodeSize - jit->p < BlockReserve) {
+    risc_jit_flush(jit);
+  }
+
+  struct Decoded insn[MaxBlockLen];
+  uint32_t len = 0;
+  while (len < MaxBlockLen && pc + len < jit->code_words) {
+    struct Decoded d = risc_decode(risc->RAM[pc + len]);
+    if (!translatable(d.kind)) {
+      break;
+    }
+    insn[len++] = d;
+    if (d.kind == BR_R || d.kind == BR_I) {
+      break;
+    }
+  }
+
+  struct Block *b = arena_alloc(jit, sizeof(*b));
+  b->pc = pc;
+  b->len = len;
+  if (len == 0) {
+    b->len = 1;
+    b->interpret = true;
+  } else {
+    emit_block(jit, b, insn);
+  }
+
+  jit->map[pc] = b;
+  memset(jit->code_map + pc, 1, b->len);
+  uint32_t first = pc >> WordPageShift, last = (pc + b->len - 1) >> WordPageShift;
+  for (uint32_t page = first; page <= last; page++) {
+    add_to_page(jit, page, b);
+    // Send the interpreter's stores to this page through risc_store_word,
+    // which checks the code map.
+    risc->store_map[page] = NULL;
+  }
+  return b;
+}
+
+void risc_jit_invalidate(struct RISC_JIT *jit, uint32_t address) {
+  uint32_t w = address / 4;
+  uint32_t page = w >> WordPageShift;
+  uint32_t start = page << WordPageShift;
+  uint32_t end = start + (1 << WordPageShift);
+  if (end > jit->words) {
+    end = jit->words;
+  }
+
+  for (struct PageEntry *e = jit->pages[page]; e; e = e->next) {
+    struct Block *b = e->block;
+    if (!b->dead && w >= b->pc && w < b->pc + b->len) {
+      b->dead = true;
+      if (jit->map[b->pc] == b) {
+        jit->map[b->pc] = NULL;
+      }
+      unchain(b);
+      jit->generation++;
+    }
+  }
+
+  // Rebuild the page's share of the code map from the blocks left.
+  memset(jit->code_map + start, 0, end - start);
+  struct PageEntry **pe = &jit->pages[page];
+  while (*pe) {
+    struct Block *b = (*pe)->block;
+    if (b->dead) {
+      *pe = (*pe)->next;
+    } else {
+      memset(jit->code_map + b->pc, 1, b->len);
+      pe = &(*pe)->next;
+    }
+  }
+}
+
+int risc_jit_run(struct RISC_JIT *jit, struct RISC *risc, int cycles) {
+  uint32_t pc = risc->PC;
+  if (pc >= jit->code_words) {
+    return 0;
+  }
+  struct Block *b = jit->map[pc];
+  if (!b) {
+    b = translate(jit, risc, pc);
+  }
+  if (b->interpret) {
+    return -(int)b->len;
+  }
+  if ((int)b->len > cycles) {
+    return -cycles;
+  }
+
+  jit->last_link = NULL;
+  int n = jit->enter(risc, b->entry, cycles);
+
+  // If we left through an unchained exit, chain it for next time.
+  struct Link *link = jit->last_link;
+  if (link && link->target < jit->code_words) {
+    struct Block *target = jit->map[link->target];
+    if (target && !target->interpret) {
+      patch(link->site, target->entry);
+      link->next = target->incoming;
+      target->incoming = link;
+    }
+  }
+  return n;
+}
+
+#else
+
+struct RISC_JIT *risc_jit_new(struct RISC *risc) {
+  fprintf(stderr, "The JIT is only available on x86-64, using the interpreter.\n");
+  return NULL;
+}
+
+void risc_jit_free(struct RISC_JIT *jit) {
+}
+
+int risc_jit_run(struct RISC_JIT *jit, struct RISC *risc, int cycles) {
+  return 0;
+}
+
+void risc_jit_invalidate(struct RISC_JIT *jit, uint32_t address) {
+}
+
+void risc_jit_flush(struct RISC_JIT *jit) {
+}
+
+#endif
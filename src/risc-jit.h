@@ -0,0 +1,24 @@
+#ifndef RISC_JIT_H
+#define RISC_JIT_H
+
+#include <stdint.h>
+
+struct RISC;
+struct RISC_JIT;
+
+// Returns NULL if translation isn't supported on this host.
+struct RISC_JIT *risc_jit_new(struct RISC *risc);
+void risc_jit_free(struct RISC_JIT *jit);
+
+// Runs translated code starting at risc->PC for at most cycles
+// instructions. Returns the number of instructions retired, or minus the
+// number of instructions the caller should interpret instead.
+int risc_jit_run(struct RISC_JIT *jit, struct RISC *risc, int cycles);
+
+// Drops the translations covering the RAM word at address.
+void risc_jit_invalidate(struct RISC_JIT *jit, uint32_t address);
+
+// Drops all translations.
+void risc_jit_flush(struct RISC_JIT *jit);
+
+#endif  // RISC_JIT_H
@@ -0,0 +1,357 @@
+// A sampling profiler for guest code.
+//
+// Every so often risc_run hands us the CPU state. We find the Oberon
+// procedure it is in and, optionally, walk the stack to find its
+// callers. Procedures are named after the module list the inner core
+// keeps in RAM: the module comes from the descriptor whose block holds
+// the code, the procedure from the module's command table. Procedures
+// that aren't commands are shown as Module.@offset, their byte offset
+// in the module's code, which is what the object file decoder prints.
+//
+// The stack walk relies on the code the Oberon compiler generates for
+// every procedure:
+//
+//   SUB SP, SP, framesize      entry
+//   STW LNK, SP, 0
+//   ...
+//   LDW LNK, SP, 0             exit
+//   ADD SP, SP, framesize
+//   B LNK
+//
+// so the return address of each frame is at [SP] and the caller's frame
+// starts framesize bytes further up. Code that doesn't follow this
+// pattern (the boot loader, hand-written assembly) ends the walk.
+
+#include <stdlib.h>
+#include <string.h>
+#include "risc-internal.h"
+#include "risc-profile.h"
+
+#define MaxDepth   64
+#define MaxModules 256
+
+// Frames that aren't a procedure entry address.
+#define RomFrame     0xFFFFFFFFu
+#define UnknownFrame 0xFFFFFFFEu
+
+#define PrologueSub 0x4EE90000u  // SUB SP, SP, imm
+#define PrologueStw 0xAFE00000u  // STW LNK, SP, 0
+#define EpilogueAdd 0x4EE80000u  // ADD SP, SP, imm
+#define ReturnBr    0xC700000Fu  // B LNK
+
+// The parts of an Oberon module descriptor (Modules.ModDesc) we use.
+struct Module {
+  uint32_t desc;
+  uint32_t code, imp, cmd, ent;
+};
+
+struct Stack {
+  uint64_t count;  // 0 if the slot is free
+  uint32_t hash;
+  int depth;
+  uint32_t frames[MaxDepth];  // innermost first
+};
+
+struct Name {
+  uint32_t frame;
+  char *name;  // NULL if the slot is free
+};
+
+struct RISC_Profile {
+  bool stacks;
+  struct Stack *stack_table;
+  uint32_t stack_size, stack_used;
+  struct Name *name_table;
+  uint32_t name_size, name_used;
+};
+
+struct RISC_Profile *risc_profile_new(bool stacks) {
+  struct RISC_Profile *profile = calloc(1, sizeof(*profile));
+  profile->stacks = stacks;
+  profile->stack_size = 256;
+  profile->stack_table = calloc(profile->stack_size, sizeof(struct Stack));
+  profile->name_size = 256;
+  profile->name_table = calloc(profile->name_size, sizeof(struct Name));
+  return profile;
+}
+
+void risc_profile_free(struct RISC_Profile *profile) {
+  for (uint32_t i = 0; i < profile->name_size; i++) {
+    free(profile->name_table[i].name);
+  }
+  free(profile->name_table);
+  free(profile->stack_table);
+  free(profile);
+}
+
+static uint32_t peek(struct RISC *risc, uint32_t address) {
+  if (address >= risc->mem_size) {
+    return 0;
+  }
+  return risc->RAM[address / 4];
+}
+
+static uint8_t peek_byte(struct RISC *risc, uint32_t address) {
+  return (uint8_t)(peek(risc, address) >> (address % 4 * 8));
+}
+
+// Finds the loaded module whose block contains address. The boot loader
+// leaves the head of the list of inner core modules at address 20; the
+// last one in that list is the first module in memory. Modules.Load puts
+// every later module right after the previous one (or in the hole a freed
+// one left), so stepping through the blocks by their size visits them all.
+static bool find_module(struct RISC *risc, uint32_t address, struct Module *m) {
+  uint32_t desc = peek(risc, 20);
+  if (desc == 0) {
+    return false;
+  }
+  for (int i = 0; i < MaxModules; i++) {
+    uint32_t next = peek(risc, desc + 32);
+    if (next == 0 || next >= desc) {
+      break;
+    }
+    desc = next;
+  }
+  for (int i = 0; i < MaxModules; i++) {
+    uint32_t size = peek(risc, desc + 44);
+    if (size == 0 || size % 4 != 0 || size > risc->mem_size - desc) {
+      return false;
+    }
+    if (address - desc < size) {
+      if (peek_byte(risc, desc) == 0) {
+        return false;  // freed
+      }
+      m->desc = desc;
+      m->code = peek(risc, desc + 56);
+      m->imp = peek(risc, desc + 60);
+      m->cmd = peek(risc, desc + 64);
+      m->ent = peek(risc, desc + 68);
+      return address >= m->code && address < m->imp;
+    }
+    desc += size;
+  }
+  return false;
+}
+
+// Searches backwards from address for the entry of the procedure it is in.
+static bool find_entry(struct RISC *risc, const struct Module *m, uint32_t address,
+                       uint32_t *entry, uint32_t *frame_size) {
+  for (uint32_t a = address & ~3u; a >= m->code && a != 0; a -= 4) {
+    uint32_t ir = peek(risc, a);
+    if ((ir & 0xFFFF0000) == PrologueSub && peek(risc, a + 4) == PrologueStw) {
+      *entry = a;
+      *frame_size = ir & 0xFFFF;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void procedure_name(struct RISC *risc, const struct Module *m, uint32_t entry,
+                           char *buf, size_t size) {
+  char module[32];
+  int n = 0;
+  while (n < 31 && (module[n] = (char)peek_byte(risc, m->desc + n)) != 0) {
+    n++;
+  }
+  module[n] = 0;
+
+  uint32_t offset = entry - m->code;
+  if (offset == peek(risc, m->ent)) {
+    snprintf(buf, size, "%s.BEGIN", module);
+    return;
+  }
+  // Each command is its name, padded to a word, then its code offset.
+  uint32_t a = m->cmd;
+  while (a < m->ent && peek_byte(risc, a) != 0) {
+    char command[32];
+    n = 0;
+    for (char c; a < m->ent && (c = (char)peek_byte(risc, a)) != 0; a++) {
+      if (n < 31) {
+        command[n++] = c;
+      }
+    }
+    command[n] = 0;
+    a = (a + 4) & ~3u;
+    if (peek(risc, a) == offset) {
+      snprintf(buf, size, "%s.%s", module, command);
+      return;
+    }
+    a += 4;
+  }
+  snprintf(buf, size, "%s.@%X", module, offset);
+}
+
+static uint32_t mix(uint32_t h) {
+  h *= 2654435761u;
+  return h ^ (h >> 16);
+}
+
+static uint32_t hash_frame(uint32_t frame) {
+  return mix(frame);
+}
+
+// Names are looked up when a frame is first seen, while its module is
+// still loaded.
+static void remember_name(struct RISC_Profile *profile, struct RISC *risc,
+                          const struct Module *m, uint32_t frame) {
+  uint32_t mask = profile->name_size - 1;
+  uint32_t i = hash_frame(frame) & mask;
+  while (profile->name_table[i].name) {
+    if (profile->name_table[i].frame == frame) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+
+  char buf[80];
+  if (frame == RomFrame) {
+    snprintf(buf, sizeof(buf), "ROM");
+  } else if (frame == UnknownFrame) {
+    snprintf(buf, sizeof(buf), "?");
+  } else {
+    procedure_name(risc, m, frame, buf, sizeof(buf));
+  }
+  profile->name_table[i].frame = frame;
+  profile->name_table[i].name = malloc(strlen(buf) + 1);
+  strcpy(profile->name_table[i].name, buf);
+
+  if (++profile->name_used * 2 > profile->name_size) {
+    struct Name *old = profile->name_table;
+    uint32_t old_size = profile->name_size;
+    profile->name_size *= 2;
+    profile->name_table = calloc(profile->name_size, sizeof(struct Name));
+    mask = profile->name_size - 1;
+    for (uint32_t j = 0; j < old_size; j++) {
+      if (old[j].name) {
+        i = hash_frame(old[j].frame) & mask;
+        while (profile->name_table[i].name) {
+          i = (i + 1) & mask;
+        }
+        profile->name_table[i] = old[j];
+      }
+    }
+    free(old);
+  }
+}
+
+static const char *frame_name(struct RISC_Profile *profile, uint32_t frame) {
+  uint32_t mask = profile->name_size - 1;
+  for (uint32_t i = hash_frame(frame) & mask; profile->name_table[i].name; i = (i + 1) & mask) {
+    if (profile->name_table[i].frame == frame) {
+      return profile->name_table[i].name;
+    }
+  }
+  return "?";
+}
+
+static void count_stack(struct RISC_Profile *profile, const uint32_t *frames, int depth) {
+  uint32_t hash = 0;
+  for (int i = 0; i < depth; i++) {
+    hash = (hash ^ frames[i]) * 16777619u;
+  }
+  hash = mix(hash);
+  uint32_t mask = profile->stack_size - 1;
+  uint32_t i = hash & mask;
+  for (; profile->stack_table[i].count; i = (i + 1) & mask) {
+    struct Stack *s = &profile->stack_table[i];
+    if (s->hash == hash && s->depth == depth &&
+        memcmp(s->frames, frames, depth * sizeof(uint32_t)) == 0) {
+      s->count++;
+      return;
+    }
+  }
+  struct Stack *s = &profile->stack_table[i];
+  s->count = 1;
+  s->hash = hash;
+  s->depth = depth;
+  memcpy(s->frames, frames, depth * sizeof(uint32_t));
+
+  if (++profile->stack_used * 2 > profile->stack_size) {
+    struct Stack *old = profile->stack_table;
+    uint32_t old_size = profile->stack_size;
+    profile->stack_size *= 2;
+    profile->stack_table = calloc(profile->stack_size, sizeof(struct Stack));
+    mask = profile->stack_size - 1;
+    for (uint32_t j = 0; j < old_size; j++) {
+      if (old[j].count) {
+        i = old[j].hash & mask;
+        while (profile->stack_table[i].count) {
+          i = (i + 1) & mask;
+        }
+        profile->stack_table[i] = old[j];
+      }
+    }
+    free(old);
+  }
+}
+
+void risc_profile_sample(struct RISC_Profile *profile, struct RISC *risc) {
+  uint32_t frames[MaxDepth];
+  int depth = 0;
+  uint32_t pc = risc->PC * 4;  // the next instruction
+  struct Module m;
+
+  if (risc->PC >= ROMStart / 4) {
+    frames[depth++] = RomFrame;
+    remember_name(profile, risc, NULL, RomFrame);
+  } else if (!find_module(risc, pc, &m)) {
+    frames[depth++] = UnknownFrame;
+    remember_name(profile, risc, NULL, UnknownFrame);
+  } else {
+    uint32_t sp = risc->R[14];
+    for (;;) {
+      uint32_t entry, frame_size;
+      if (!find_entry(risc, &m, pc, &entry, &frame_size)) {
+        break;
+      }
+      frames[depth++] = entry;
+      remember_name(profile, risc, &m, entry);
+      if (!profile->stacks || depth == MaxDepth) {
+        break;
+      }
+
+      // In the innermost frame the return address may still (or again)
+      // be in LNK, and SP may not have moved yet.
+      uint32_t ret;
+      uint32_t ir = peek(risc, pc);
+      if (depth > 1) {
+        ret = peek(risc, sp);
+        sp += frame_size;
+      } else if (pc == entry) {
+        ret = risc->R[15];
+      } else if (pc == entry + 4 || ir == (EpilogueAdd | frame_size)) {
+        ret = risc->R[15];
+        sp += frame_size;
+      } else if (ir == ReturnBr) {
+        ret = risc->R[15];
+      } else {
+        ret = peek(risc, sp);
+        sp += frame_size;
+      }
+
+      // Continue at the branch-and-link that made the call.
+      pc = ret - 4;
+      if (ret == 0 || ret % 4 != 0 || !find_module(risc, pc, &m)) {
+        break;
+      }
+    }
+    if (depth == 0) {
+      frames[depth++] = UnknownFrame;
+      remember_name(profile, risc, NULL, UnknownFrame);
+    }
+  }
+  count_stack(profile, frames, depth);
+}
+
+void risc_profile_write(struct RISC_Profile *profile, FILE *f) {
+  for (uint32_t i = 0; i < profile->stack_size; i++) {
+    struct Stack *s = &profile->stack_table[i];
+    if (s->count) {
+      for (int j = s->depth - 1; j >= 0; j--) {
+        fprintf(f, "%s%s", frame_name(profile, s->frames[j]), j ? ";" : "");
+      }
+      fprintf(f, " %llu\n", (unsigned long long)s->count);
+    }
+  }
+}
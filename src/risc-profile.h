@@ -0,0 +1,23 @@
+#ifndef RISC_PROFILE_H
+#define RISC_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct RISC;
+struct RISC_Profile;
+
+struct RISC_Profile *risc_profile_new(bool stacks);
+void risc_profile_free(struct RISC_Profile *profile);
+
+// Records where the guest is right now: the procedure at risc->PC and,
+// if call stacks were asked for, its callers.
+void risc_profile_sample(struct RISC_Profile *profile, struct RISC *risc);
+
+// Writes one line per distinct call stack, outermost procedure first,
+// followed by the number of samples ("Oberon.Loop;System.Directory 12").
+// This is the collapsed format flame graph tools read.
+void risc_profile_write(struct RISC_Profile *profile, FILE *f);
+
+#endif  // RISC_PROFILE_H
@@ -5,77 +5,76 @@
 #include <stdio.h>
 #include <time.h>
 #include "risc.h"
+#include "risc-internal.h"
 #include "risc-fp.h"
+#include "risc-jit.h"
+#include "risc-profile.h"
 
 
-// Our memory layout is slightly different from the FPGA implementation:
-// The FPGA uses a 20-bit address bus and thus ignores the top 12 bits,
-// while we use all 32 bits. This allows us to have more than 1 megabyte
-// of RAM and/or a 16 color framebuffer.
-//
-// In the default configuration, the emulator is compatible with the
-// FPGA system. But If the user requests more memory, we move the
-// framebuffer to make room for a larger Oberon heap. This requires a
-// custom Display.Mod.
-
-
-#define DefaultMemSize      0x00100000
-#define DefaultDisplayStart 0x000E7F00
-
-#define ROMStart     0xFFFFF800
-#define ROMWords     512
-#define IOStart      0xFFFFFFC0
-#define PaletteStart 0xFFFFFF80
-
-
-struct RISC {
-  uint32_t PC;
-  uint32_t R[16];
-  uint32_t H;
-  bool     Z, N, C, V;
-
-  uint32_t mem_size;
-  uint32_t display_start;
-
-  uint32_t progress;
-  uint32_t current_tick;
-  uint32_t mouse;
-  uint8_t  key_buf[16];
-  uint32_t key_cnt;
-  uint32_t switches;
-
-  const struct RISC_LED *leds;
-  const struct RISC_Serial *serial;
-  uint32_t spi_selected;
-  const struct RISC_SPI *spi[4];
-  const struct RISC_Clipboard *clipboard;
-  const struct RISC_HostFS *hostfs;
-
-  bool fb_color;
-  int fb_width;   // words
-  int fb_height;  // lines
-  struct Damage damage;
-
-  uint32_t *RAM;
-  uint32_t ROM[ROMWords];
-  uint32_t Palette[16];
-};
-
-enum {
-  MOV, LSL, ASR, ROR,
-  AND, ANN, IOR, XOR,
-  ADD, SUB, MUL, DIV,
-  FAD, FSB, FML, FDV,
-};
-
 static void risc_single_step(struct RISC *risc);
+static int risc_run_core(struct RISC *risc, int cycles);
+static int risc_run_decoded(struct RISC *risc, int cycles);
+static int risc_run_jit(struct RISC *risc, int cycles);
+static void risc_fuse(struct Decoded *d, const uint32_t *code, uint32_t avail);
+static void risc_execute(struct RISC *risc, uint32_t ir);
+static bool risc_condition(struct RISC *risc, uint32_t cond);
+static bool risc_flag_N(struct RISC *risc);
+static bool risc_flag_Z(struct RISC *risc);
+static bool risc_flag_C(struct RISC *risc);
+static bool risc_flag_V(struct RISC *risc);
+static void risc_set_add_flags(struct RISC *risc, uint32_t b_val, uint32_t c_val);
+static void risc_set_sub_flags(struct RISC *risc, uint32_t b_val, uint32_t c_val);
+static void risc_set_carry_overflow(struct RISC *risc, bool c, bool v);
 static void risc_set_register(struct RISC *risc, int reg, uint32_t value);
 static uint32_t risc_load_word(struct RISC *risc, uint32_t address);
 static uint8_t risc_load_byte(struct RISC *risc, uint32_t address);
 static void risc_store_word(struct RISC *risc, uint32_t address, uint32_t value);
 static void risc_store_byte(struct RISC *risc, uint32_t address, uint8_t value);
+static uint32_t risc_load_unmapped(struct RISC *risc, uint32_t address);
+static void risc_store_unmapped(struct RISC *risc, uint32_t address, uint32_t value);
+static void risc_poll(struct RISC *risc, bool timer);
+static void risc_wake(struct RISC *risc);
+static void risc_store_byte_unmapped(struct RISC *risc, uint32_t address, uint8_t value);
 static uint32_t risc_load_io(struct RISC *risc, uint32_t address);
 static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value);
+static void risc_disk_dma(struct RISC *risc, uint32_t address);
+static void risc_init_damage(struct RISC *risc);
+static void risc_damage_all(struct RISC *risc);
+
+// Byte accesses to mapped RAM go straight to the byte in host memory,
+// which is only the right byte if the host is little-endian.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define RISC_LITTLE_ENDIAN 1
+#elif defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define RISC_LITTLE_ENDIAN 1
+#else
+#define RISC_LITTLE_ENDIAN 0
+#endif
+
+// Builds with RISC_REFERENCE_CORE run the original, decode-every-time
+// interpreter instead of the decode cache. Useful for checking the fast
+// paths against.
+#ifdef RISC_REFERENCE_CORE
+static const bool reference_core = true;
+#else
+static const bool reference_core = false;
+#endif
+
+// Builds with RISC_FUSION_STATS count how often each superinstruction
+// runs and print the totals on exit.
+#ifdef RISC_FUSION_STATS
+static unsigned long long fusion_count[SUB_I_BR - MOV_IOR + 1];
+#define FUSION_STAT(kind) (fusion_count[(kind) - MOV_IOR]++)
+
+static void risc_print_fusion_stats(void) {
+  static const char *const names[] = { "MOV'+IOR", "LDW+ADD+STW", "SUB+B (register)", "SUB+B (immediate)" };
+  for (int i = 0; i < SUB_I_BR - MOV_IOR + 1; i++) {
+    fprintf(stderr, "%-18s %12llu\n", names[i], fusion_count[i]);
+  }
+}
+#else
+#define FUSION_STAT(kind) ((void)0)
+#endif
 
 static const uint32_t bootloader[ROMWords] = {
 #include "risc-boot.inc"
@@ -93,15 +92,18 @@ struct RISC *risc_new() {
   risc->display_start = DefaultDisplayStart;
   risc->fb_width = RISC_FRAMEBUFFER_WIDTH / 32;
   risc->fb_height = RISC_FRAMEBUFFER_HEIGHT;
-  risc->damage = (struct Damage){
-    .x1 = 0,
-    .y1 = 0,
-    .x2 = risc->fb_width - 1,
-    .y2 = risc->fb_height - 1
-  };
+  risc_init_damage(risc);
   risc->RAM = calloc(1, risc->mem_size);
+  risc->RAM_decoded = calloc(risc->mem_size / 4, sizeof(struct Decoded));
+  risc->load_map = calloc(PageCount, sizeof(*risc->load_map));
+  risc->store_map = calloc(PageCount, sizeof(*risc->store_map));
+  risc_map_memory(risc);
   memcpy(risc->ROM, bootloader, sizeof(risc->ROM));
+  risc->flag_value = 1;  // Z clear
   risc_reset(risc);
+#ifdef RISC_FUSION_STATS
+  atexit(risc_print_fusion_stats);
+#endif
   return risc;
 }
 
@@ -123,15 +125,24 @@ void risc_configure_memory(struct RISC *risc, int megabytes_ram, bool rtc_option
     risc->mem_size = risc->display_start + (screen_width * screen_height) / 2;
     memcpy(risc->Palette, default_palette, sizeof(risc->Palette));
   }
-  risc->damage = (struct Damage){
-    .x1 = 0,
-    .y1 = 0,
-    .x2 = risc->fb_width - 1,
-    .y2 = risc->fb_height - 1
-  };
+  risc_init_damage(risc);
 
   free(risc->RAM);
   risc->RAM = calloc(1, risc->mem_size);
+  free(risc->RAM_decoded);
+  risc->RAM_decoded = calloc(risc->mem_size / 4, sizeof(struct Decoded));
+  free(risc->load_map);
+  free(risc->store_map);
+  risc->load_map = calloc(PageCount, sizeof(*risc->load_map));
+  risc->store_map = calloc(PageCount, sizeof(*risc->store_map));
+  risc_map_memory(risc);
+  if (risc->jit) {
+    // The translator sizes its tables by the amount of RAM.
+    risc_jit_free(risc->jit);
+    risc->jit = NULL;
+    risc->jit_code_map = NULL;
+    risc->jit = risc_jit_new(risc);
+  }
 
   // Patch the new constants in the bootloader.
   uint32_t mem_lim = risc->display_start - 16;
@@ -139,6 +150,7 @@ void risc_configure_memory(struct RISC *risc, int megabytes_ram, bool rtc_option
   risc->ROM[373] = 0x41160000 + (mem_lim & 0x0000FFFF);
   uint32_t stack_org = risc->display_start / 2;
   risc->ROM[376] = 0x61000000 + (stack_org >> 16);
+  memset(risc->ROM_decoded, 0, sizeof(risc->ROM_decoded));
 
   // patch the time for RTC option
   if (rtc_option) {
@@ -189,21 +201,120 @@ void risc_set_host_fs(struct RISC *risc, const struct RISC_HostFS *hostfs) {
   risc->hostfs = hostfs;
 }
 
+void risc_set_disk_dma(struct RISC *risc, const struct RISC_DiskDMA *dma) {
+  risc->disk_dma = dma;
+}
+
 void risc_reset(struct RISC *risc) {
   risc->PC = ROMStart/4;
+  risc_wake(risc);
 }
 
-void risc_run(struct RISC *risc, int cycles) {
-  risc->progress = 20;
+int risc_run(struct RISC *risc, int cycles) {
   // The progress value is used to detect that the RISC cpu is busy
   // waiting on the millisecond counter or on the keyboard ready
-  // bit. In that case it's better to just pause emulation until the
-  // next frame.
-  for (int i = 0; i < cycles && risc->progress; i++) {
-    risc_single_step(risc);
+  // bit. In that case it's better to just pause emulation until
+  // there's new input or the time changes. See risc_poll.
+  if (!risc->progress && risc->serial) {
+    // Serial data arriving is input too. Only wake up when the line
+    // becomes readable, as one that stays readable (at end of file,
+    // say) would otherwise keep the guest from ever going idle.
+    bool ready = risc->serial->read_status(risc->serial) & 1;
+    if (ready && !risc->serial_ready) {
+      risc_wake(risc);
+    }
+    risc->serial_ready = ready;
+  }
+  if (!risc->profile) {
+    return risc_run_core(risc, cycles);
+  }
+  // Stop every profile_interval instructions to take a sample.
+  int done = 0;
+  while (done < cycles && risc->progress) {
+    int n = cycles - done;
+    if (n > risc->profile_countdown) {
+      n = risc->profile_countdown;
+    }
+    n = risc_run_core(risc, n);
+    done += n;
+    risc->profile_countdown -= n;
+    if (risc->profile_countdown == 0) {
+      risc_profile_sample(risc->profile, risc);
+      risc->profile_countdown = risc->profile_interval;
+    }
+  }
+  return done;
+}
+
+static int risc_run_core(struct RISC *risc, int cycles) {
+  if (reference_core) {
+    int i;
+    for (i = 0; i < cycles && risc->progress; i++) {
+      risc_single_step(risc);
+    }
+    return i;
+  } else if (risc->jit) {
+    return risc_run_jit(risc, cycles);
+  } else {
+    return risc_run_decoded(risc, cycles);
+  }
+}
+
+bool risc_is_idle(struct RISC *risc) {
+  return risc->progress == 0;
+}
+
+void risc_enable_profiler(struct RISC *risc, int interval, bool stacks) {
+  if (risc->profile) {
+    risc_profile_free(risc->profile);
+  }
+  if (interval < 1) {
+    interval = 1;
+  }
+  risc->profile = risc_profile_new(stacks);
+  risc->profile_interval = interval;
+  risc->profile_countdown = interval;
+}
+
+bool risc_write_profile(struct RISC *risc, const char *filename) {
+  if (!risc->profile) {
+    return false;
+  }
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    return false;
+  }
+  risc_profile_write(risc->profile, f);
+  return fclose(f) == 0;
+}
+
+bool risc_enable_jit(struct RISC *risc) {
+  if (!risc->jit) {
+    risc->jit = risc_jit_new(risc);
+  }
+  return risc->jit != NULL;
+}
+
+// Runs translated blocks where there are any. risc_jit_run returns the
+// number of instructions it retired, or minus the number of instructions
+// it wants interpreted (0 if PC is outside RAM or can't be translated).
+static int risc_run_jit(struct RISC *risc, int cycles) {
+  int i = 0;
+  while (i < cycles && risc->progress) {
+    int n = risc_jit_run(risc->jit, risc, cycles - i);
+    if (n <= 0) {
+      n = n < 0 ? -n : 1;
+      if (n > cycles - i) {
+        n = cycles - i;
+      }
+      n = risc_run_decoded(risc, n);
+    }
+    i += n;
   }
+  return i;
 }
 
+// The reference interpreter: decodes every instruction from scratch.
 static void risc_single_step(struct RISC *risc) {
   uint32_t ir;
   if (risc->PC < risc->mem_size / 4) {
@@ -216,7 +327,439 @@ static void risc_single_step(struct RISC *risc) {
     return;
   }
   risc->PC++;
+  risc_execute(risc, ir);
+}
+
+// Returns the decode cache entry for the instruction at PC and advances
+// PC past it. The entry may still be UNDECODED.
+static inline struct Decoded *risc_fetch(struct RISC *risc) {
+  static struct Decoded void_insn = { .kind = VOID };
+  struct Decoded *d;
+  uint32_t pc = risc->PC;
+  if (pc < risc->mem_size / 4) {
+    d = &risc->RAM_decoded[pc];
+  } else if (pc >= ROMStart/4 && pc < ROMStart/4 + ROMWords) {
+    d = &risc->ROM_decoded[pc - ROMStart/4];
+  } else {
+    return &void_insn;
+  }
+  risc->PC = pc + 1;
+  return d;
+}
+
+// The fast interpreter, running from the decode cache. Every handler
+// ends with NEXT, which fetches the next instruction and jumps to its
+// handler. With GCC and clang that is a computed goto at the end of each
+// handler, so the host branch predictor sees one indirect jump per
+// handler instead of a single shared one. Other compilers, or builds with
+// RISC_SWITCH_DISPATCH, fall back to an ordinary switch.
+#if defined(__GNUC__) && !defined(RISC_SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#define DISPATCH(kind)  goto *handlers[kind];
+#define REDISPATCH      goto *handlers[d->kind]
+#define FALLBACK(kind)  goto op_##kind
+#define HANDLER(kind)   op_##kind:
+#define NEXT            do { if (++i >= cycles || !risc->progress) return i; \
+                             d = risc_fetch(risc); goto *handlers[d->kind]; } while (0)
+#else
+#define DISPATCH(k)     kind = (k); redispatch: switch (kind)
+#define REDISPATCH      do { kind = d->kind; goto redispatch; } while (0)
+#define FALLBACK(k)     do { kind = (k); goto redispatch; } while (0)
+#define HANDLER(kind)   case kind:
+#define NEXT            break
+#endif
+
+static int risc_run_decoded(struct RISC *risc, int cycles) {
+#ifdef THREADED_DISPATCH
+  static const void *const handlers[] = {
+    [UNDECODED] = &&op_UNDECODED,
+    [VOID] = &&op_VOID,
+    [GENERIC] = &&op_GENERIC,
+    [MOV_R] = &&op_MOV_R, [LSL_R] = &&op_LSL_R, [ASR_R] = &&op_ASR_R, [ROR_R] = &&op_ROR_R,
+    [AND_R] = &&op_AND_R, [ANN_R] = &&op_ANN_R, [IOR_R] = &&op_IOR_R, [XOR_R] = &&op_XOR_R,
+    [ADD_R] = &&op_ADD_R, [SUB_R] = &&op_SUB_R, [MUL_R] = &&op_MUL_R,
+    [MOV_I] = &&op_MOV_I, [LSL_I] = &&op_LSL_I, [ASR_I] = &&op_ASR_I, [ROR_I] = &&op_ROR_I,
+    [AND_I] = &&op_AND_I, [ANN_I] = &&op_ANN_I, [IOR_I] = &&op_IOR_I, [XOR_I] = &&op_XOR_I,
+    [ADD_I] = &&op_ADD_I, [SUB_I] = &&op_SUB_I, [MUL_I] = &&op_MUL_I,
+    [LDW] = &&op_LDW, [LDB] = &&op_LDB, [STW] = &&op_STW, [STB] = &&op_STB,
+    [BR_R] = &&op_BR_R, [BR_I] = &&op_BR_I,
+    [MOV_IOR] = &&op_MOV_IOR, [LDW_ADD_STW] = &&op_LDW_ADD_STW,
+    [SUB_R_BR] = &&op_SUB_R_BR, [SUB_I_BR] = &&op_SUB_I_BR,
+  };
+#else
+  uint8_t kind;
+#endif
+  if (cycles <= 0 || !risc->progress) {
+    return 0;
+  }
+  for (int i = 0;;) {
+    struct Decoded *d = risc_fetch(risc);
+    DISPATCH(d->kind) {
+      HANDLER(UNDECODED) {
+        uint32_t pc = risc->PC - 1;
+        if (pc < risc->mem_size / 4) {
+          *d = risc_decode(risc->RAM[pc]);
+          risc_fuse(d, &risc->RAM[pc], risc->mem_size / 4 - pc);
+        } else {
+          *d = risc_decode(risc->ROM[pc - ROMStart/4]);
+          risc_fuse(d, &risc->ROM[pc - ROMStart/4], ROMStart/4 + ROMWords - pc);
+        }
+        REDISPATCH;
+      }
+      HANDLER(VOID) {
+        fprintf(stderr, "Branched into the void (PC=0x%08X), resetting...\n", risc->PC);
+        risc_reset(risc);
+        NEXT;
+      }
+      HANDLER(GENERIC) { risc_execute(risc, d->imm); NEXT; }
+      HANDLER(MOV_R) { risc_set_register(risc, d->a, risc->R[d->c]); NEXT; }
+      HANDLER(LSL_R) { risc_set_register(risc, d->a, risc->R[d->b] << (risc->R[d->c] & 31)); NEXT; }
+      HANDLER(ASR_R) { risc_set_register(risc, d->a, ((int32_t)risc->R[d->b]) >> (risc->R[d->c] & 31)); NEXT; }
+      HANDLER(ROR_R) {
+        uint32_t b_val = risc->R[d->b], c_val = risc->R[d->c];
+        risc_set_register(risc, d->a, (b_val >> (c_val & 31)) | (b_val << (-c_val & 31)));
+        NEXT;
+      }
+      HANDLER(AND_R) { risc_set_register(risc, d->a, risc->R[d->b] & risc->R[d->c]); NEXT; }
+      HANDLER(ANN_R) { risc_set_register(risc, d->a, risc->R[d->b] & ~risc->R[d->c]); NEXT; }
+      HANDLER(IOR_R) { risc_set_register(risc, d->a, risc->R[d->b] | risc->R[d->c]); NEXT; }
+      HANDLER(XOR_R) { risc_set_register(risc, d->a, risc->R[d->b] ^ risc->R[d->c]); NEXT; }
+      HANDLER(ADD_R) {
+        uint32_t b_val = risc->R[d->b], c_val = risc->R[d->c];
+        uint32_t a_val = b_val + c_val;
+        risc_set_add_flags(risc, b_val, c_val);
+        risc_set_register(risc, d->a, a_val);
+        NEXT;
+      }
+      HANDLER(SUB_R) {
+        uint32_t b_val = risc->R[d->b], c_val = risc->R[d->c];
+        uint32_t a_val = b_val - c_val;
+        risc_set_sub_flags(risc, b_val, c_val);
+        risc_set_register(risc, d->a, a_val);
+        NEXT;
+      }
+      HANDLER(MUL_R) {
+        uint64_t tmp = (int64_t)(int32_t)risc->R[d->b] * (int64_t)(int32_t)risc->R[d->c];
+        risc->H = (uint32_t)(tmp >> 32);
+        risc_set_register(risc, d->a, (uint32_t)tmp);
+        NEXT;
+      }
+      HANDLER(MOV_I) { risc_set_register(risc, d->a, d->imm); NEXT; }
+      HANDLER(LSL_I) { risc_set_register(risc, d->a, risc->R[d->b] << (d->imm & 31)); NEXT; }
+      HANDLER(ASR_I) { risc_set_register(risc, d->a, ((int32_t)risc->R[d->b]) >> (d->imm & 31)); NEXT; }
+      HANDLER(ROR_I) {
+        uint32_t b_val = risc->R[d->b];
+        risc_set_register(risc, d->a, (b_val >> (d->imm & 31)) | (b_val << (-d->imm & 31)));
+        NEXT;
+      }
+      HANDLER(AND_I) { risc_set_register(risc, d->a, risc->R[d->b] & d->imm); NEXT; }
+      HANDLER(ANN_I) { risc_set_register(risc, d->a, risc->R[d->b] & ~d->imm); NEXT; }
+      HANDLER(IOR_I) { risc_set_register(risc, d->a, risc->R[d->b] | d->imm); NEXT; }
+      HANDLER(XOR_I) { risc_set_register(risc, d->a, risc->R[d->b] ^ d->imm); NEXT; }
+      HANDLER(ADD_I) {
+        uint32_t b_val = risc->R[d->b], c_val = d->imm;
+        uint32_t a_val = b_val + c_val;
+        risc_set_add_flags(risc, b_val, c_val);
+        risc_set_register(risc, d->a, a_val);
+        NEXT;
+      }
+      HANDLER(SUB_I) {
+        uint32_t b_val = risc->R[d->b], c_val = d->imm;
+        uint32_t a_val = b_val - c_val;
+        risc_set_sub_flags(risc, b_val, c_val);
+        risc_set_register(risc, d->a, a_val);
+        NEXT;
+      }
+      HANDLER(MUL_I) {
+        uint64_t tmp = (int64_t)(int32_t)risc->R[d->b] * (int64_t)(int32_t)d->imm;
+        risc->H = (uint32_t)(tmp >> 32);
+        risc_set_register(risc, d->a, (uint32_t)tmp);
+        NEXT;
+      }
+      HANDLER(LDW) { risc_set_register(risc, d->a, risc_load_word(risc, risc->R[d->b] + d->imm)); NEXT; }
+      HANDLER(LDB) { risc_set_register(risc, d->a, risc_load_byte(risc, risc->R[d->b] + d->imm)); NEXT; }
+      HANDLER(STW) { risc_store_word(risc, risc->R[d->b] + d->imm, risc->R[d->a]); NEXT; }
+      HANDLER(STB) { risc_store_byte(risc, risc->R[d->b] + d->imm, (uint8_t)risc->R[d->a]); NEXT; }
+      HANDLER(BR_R) {
+        if (risc_condition(risc, d->b)) {
+          if (d->a) {
+            risc_set_register(risc, 15, risc->PC * 4);
+          }
+          risc->PC = risc->R[d->c] / 4;
+        }
+        NEXT;
+      }
+      HANDLER(BR_I) {
+        if (risc_condition(risc, d->b)) {
+          if (d->a) {
+            risc_set_register(risc, 15, risc->PC * 4);
+          }
+          risc->PC = risc->PC + d->imm;
+        }
+        NEXT;
+      }
+
+      // Superinstructions. The instructions after the first are in the
+      // entries that follow. If one of those is no longer the instruction
+      // the sequence was built from (cleared by a store, or decoded again
+      // since), the code changed and the sequence is decoded again. A
+      // sequence that would run past the end of the time slice runs its
+      // first instruction on its own.
+      HANDLER(MOV_IOR) {
+        if (d[1].kind != IOR_I || d[1].a != d->a || d[1].b != d->a) {
+          d->kind = UNDECODED;
+          REDISPATCH;
+        }
+        if (i + 2 > cycles) {
+          FALLBACK(MOV_I);
+        }
+        FUSION_STAT(MOV_IOR);
+        risc_set_register(risc, d->a, d->imm | d[1].imm);
+        risc->PC++;
+        i++;
+        NEXT;
+      }
+      HANDLER(LDW_ADD_STW) {
+        if (d[1].kind != ADD_I || d[1].a != d->a || d[1].b != d->a ||
+            d[2].kind != STW || d[2].a != d->a || d[2].b != d->b || d[2].imm != d->imm) {
+          d->kind = UNDECODED;
+          REDISPATCH;
+        }
+        uint32_t address = risc->R[d->b] + d->imm;
+        if (i + 3 > cycles || address >= risc->display_start) {
+          FALLBACK(LDW);
+        }
+        FUSION_STAT(LDW_ADD_STW);
+        uint32_t b_val = risc->RAM[address/4], c_val = d[1].imm;
+        uint32_t a_val = b_val + c_val;
+        risc_set_add_flags(risc, b_val, c_val);
+        risc_set_register(risc, d->a, a_val);
+        risc->PC += 2;
+        i += 2;
+        risc_store_word(risc, address, a_val);
+        NEXT;
+      }
+      HANDLER(SUB_R_BR) {
+        if (d[1].kind != BR_I) {
+          d->kind = UNDECODED;
+          REDISPATCH;
+        }
+        if (i + 2 > cycles) {
+          FALLBACK(SUB_R);
+        }
+        FUSION_STAT(SUB_R_BR);
+        uint32_t b_val = risc->R[d->b], c_val = risc->R[d->c];
+        risc_set_sub_flags(risc, b_val, c_val);
+        risc_set_register(risc, d->a, b_val - c_val);
+        goto compare_branch;
+      }
+      HANDLER(SUB_I_BR) {
+        if (d[1].kind != BR_I) {
+          d->kind = UNDECODED;
+          REDISPATCH;
+        }
+        if (i + 2 > cycles) {
+          FALLBACK(SUB_I);
+        }
+        FUSION_STAT(SUB_I_BR);
+        uint32_t b_val = risc->R[d->b], c_val = d->imm;
+        risc_set_sub_flags(risc, b_val, c_val);
+        risc_set_register(risc, d->a, b_val - c_val);
+        goto compare_branch;
+      }
+      compare_branch: {
+        struct Decoded *br = d + 1;
+        risc->PC++;
+        i++;
+        if (risc_condition(risc, br->b)) {
+          if (br->a) {
+            risc_set_register(risc, 15, risc->PC * 4);
+          }
+          risc->PC = risc->PC + br->imm;
+        }
+        NEXT;
+      }
+#ifndef THREADED_DISPATCH
+    default: abort();  // unreachable
+#endif
+    }
+    if (++i >= cycles || !risc->progress) {
+      return i;
+    }
+  }
+}
+
+#undef THREADED_DISPATCH
+#undef DISPATCH
+#undef REDISPATCH
+#undef FALLBACK
+#undef HANDLER
+#undef NEXT
+
+// Looks for a sequence starting with the instruction just decoded into d
+// that can run as one superinstruction: MOV' and IOR building a 32-bit
+// constant, a compare followed by a branch, and a load, add and store
+// to the same variable. The fused entry keeps the fields of the first
+// instruction, the others are decoded into the entries after it.
+// Branching into the middle of a sequence simply finds an ordinary
+// entry there. code points to the word for d, avail is the number of
+// words left from there.
+static void risc_fuse(struct Decoded *d, const uint32_t *code, uint32_t avail) {
+  if (avail < 2) {
+    return;
+  }
+  struct Decoded d1 = risc_decode(code[1]);
+  uint8_t kind = UNDECODED;
+  uint32_t len = 2;
+  if (d->kind == MOV_I && d1.kind == IOR_I && d1.a == d->a && d1.b == d->a) {
+    kind = MOV_IOR;
+  } else if ((d->kind == SUB_R || d->kind == SUB_I) && d1.kind == BR_I) {
+    kind = d->kind == SUB_R ? SUB_R_BR : SUB_I_BR;
+  } else if (d->kind == LDW && d1.kind == ADD_I && d1.a == d->a && d1.b == d->a &&
+             d->a != d->b && avail >= 3) {
+    struct Decoded d2 = risc_decode(code[2]);
+    if (d2.kind == STW && d2.a == d->a && d2.b == d->b && d2.imm == d->imm) {
+      kind = LDW_ADD_STW;
+      len = 3;
+    }
+  }
+  if (kind != UNDECODED) {
+    for (uint32_t k = 1; k < len; k++) {
+      if (d[k].kind == UNDECODED) {
+        d[k] = risc_decode(code[k]);
+      }
+    }
+    d->kind = kind;
+  }
+}
+
+struct Decoded risc_decode(uint32_t ir) {
+  const uint32_t pbit = 0x80000000;
+  const uint32_t qbit = 0x40000000;
+  const uint32_t ubit = 0x20000000;
+  const uint32_t vbit = 0x10000000;
+
+  struct Decoded d = {
+    .kind = GENERIC,
+    .a = (ir & 0x0F000000) >> 24,
+    .b = (ir & 0x00F00000) >> 20,
+    .c = ir & 0x0000000F,
+    .imm = ir
+  };
+
+  if ((ir & pbit) == 0) {
+    // Register instructions
+    uint32_t op = (ir & 0x000F0000) >> 16;
+    if ((ir & qbit) == 0) {
+      if ((ir & ubit) == 0 && op <= MUL) {
+        d.kind = (uint8_t)(MOV_R + op);
+      }
+    } else {
+      uint32_t im = ir & 0x0000FFFF;
+      uint32_t c_val = (ir & vbit) == 0 ? im : 0xFFFF0000 | im;
+      if ((ir & ubit) == 0 && op <= MUL) {
+        d.kind = (uint8_t)(MOV_I + op);
+        d.imm = c_val;
+      } else if (op == MOV) {
+        d.kind = MOV_I;
+        d.imm = c_val << 16;
+      }
+    }
+  }
+  else if ((ir & qbit) == 0) {
+    // Memory instructions
+    int32_t off = ir & 0x000FFFFF;
+    off = (off ^ 0x00080000) - 0x00080000;  // sign-extend
+    d.imm = (uint32_t)off;
+    if ((ir & ubit) == 0) {
+      d.kind = (ir & vbit) == 0 ? LDW : LDB;
+    } else {
+      d.kind = (ir & vbit) == 0 ? STW : STB;
+    }
+  }
+  else {
+    // Branch instructions
+    d.b = (ir >> 24) & 15;
+    d.a = (ir & vbit) != 0;
+    if ((ir & ubit) == 0) {
+      d.kind = BR_R;
+    } else {
+      int32_t off = ir & 0x00FFFFFF;
+      off = (off ^ 0x00800000) - 0x00800000;  // sign-extend
+      d.kind = BR_I;
+      d.imm = (uint32_t)off;
+    }
+  }
+  return d;
+}
+
+// The condition flags are only worked out when something reads them.
+static inline bool risc_flag_N(struct RISC *risc) {
+  return (int32_t)risc->flag_value < 0;
+}
+
+static inline bool risc_flag_Z(struct RISC *risc) {
+  return risc->flag_value == 0;
+}
+
+static inline bool risc_flag_C(struct RISC *risc) {
+  uint32_t b_val = risc->flag_b, c_val = risc->flag_c;
+  return risc->flag_sub ? b_val < c_val : b_val + c_val < b_val;
+}
+
+static inline bool risc_flag_V(struct RISC *risc) {
+  uint32_t b_val = risc->flag_b, c_val = risc->flag_c;
+  if (risc->flag_sub) {
+    uint32_t a_val = b_val - c_val;
+    return ((b_val ^ c_val) & (a_val ^ b_val)) >> 31;
+  } else {
+    uint32_t a_val = b_val + c_val;
+    return ((a_val ^ c_val) & (a_val ^ b_val)) >> 31;
+  }
+}
 
+static inline void risc_set_add_flags(struct RISC *risc, uint32_t b_val, uint32_t c_val) {
+  risc->flag_b = b_val;
+  risc->flag_c = c_val;
+  risc->flag_sub = false;
+}
+
+static inline void risc_set_sub_flags(struct RISC *risc, uint32_t b_val, uint32_t c_val) {
+  risc->flag_b = b_val;
+  risc->flag_c = c_val;
+  risc->flag_sub = true;
+}
+
+// For add/subtract with carry, whose flags can't be recomputed from the
+// two operands: records an addition that gives the same C and V.
+static void risc_set_carry_overflow(struct RISC *risc, bool c, bool v) {
+  static const uint32_t operands[4][2] = {
+    { 0x00000000, 0x00000000 },  // C=0 V=0
+    { 0x7FFFFFFF, 0x00000001 },  // C=0 V=1
+    { 0xFFFFFFFF, 0x00000001 },  // C=1 V=0
+    { 0x80000000, 0x80000000 },  // C=1 V=1
+  };
+  risc_set_add_flags(risc, operands[c * 2 + v][0], operands[c * 2 + v][1]);
+}
+
+static inline bool risc_condition(struct RISC *risc, uint32_t cond) {
+  bool t = (cond >> 3) & 1;
+  switch (cond & 7) {
+    case 0: t ^= risc_flag_N(risc); break;
+    case 1: t ^= risc_flag_Z(risc); break;
+    case 2: t ^= risc_flag_C(risc); break;
+    case 3: t ^= risc_flag_V(risc); break;
+    case 4: t ^= risc_flag_C(risc) | risc_flag_Z(risc); break;
+    case 5: t ^= risc_flag_N(risc) ^ risc_flag_V(risc); break;
+    case 6: t ^= (risc_flag_N(risc) ^ risc_flag_V(risc)) | risc_flag_Z(risc); break;
+    case 7: t ^= true; break;
+    default: abort();  // unreachable
+  }
+  return t;
+}
+
+// Executes the instruction word ir, with PC already pointing past it.
+static void risc_execute(struct RISC *risc, uint32_t ir) {
   const uint32_t pbit = 0x80000000;
   const uint32_t qbit = 0x40000000;
   const uint32_t ubit = 0x20000000;
@@ -248,10 +791,10 @@ static void risc_single_step(struct RISC *risc) {
           a_val = c_val << 16;
         } else if ((ir & vbit) != 0) {
           a_val = 0xD0 |   // ???
-            (risc->N * 0x80000000U) |
-            (risc->Z * 0x40000000U) |
-            (risc->C * 0x20000000U) |
-            (risc->V * 0x10000000U);
+            (risc_flag_N(risc) * 0x80000000U) |
+            (risc_flag_Z(risc) * 0x40000000U) |
+            (risc_flag_C(risc) * 0x20000000U) |
+            (risc_flag_V(risc) * 0x10000000U);
         } else {
           a_val = risc->H;
         }
@@ -288,19 +831,21 @@ static void risc_single_step(struct RISC *risc) {
       case ADD: {
         a_val = b_val + c_val;
         if ((ir & ubit) != 0) {
-          a_val += risc->C;
+          a_val += risc_flag_C(risc);
+          risc_set_carry_overflow(risc, a_val < b_val, ((a_val ^ c_val) & (a_val ^ b_val)) >> 31);
+        } else {
+          risc_set_add_flags(risc, b_val, c_val);
         }
-        risc->C = a_val < b_val;
-        risc->V = ((a_val ^ c_val) & (a_val ^ b_val)) >> 31;
         break;
       }
       case SUB: {
         a_val = b_val - c_val;
         if ((ir & ubit) != 0) {
-          a_val -= risc->C;
+          a_val -= risc_flag_C(risc);
+          risc_set_carry_overflow(risc, a_val > b_val, ((b_val ^ c_val) & (a_val ^ b_val)) >> 31);
+        } else {
+          risc_set_sub_flags(risc, b_val, c_val);
         }
-        risc->C = a_val > b_val;
-        risc->V = ((b_val ^ c_val) & (a_val ^ b_val)) >> 31;
         break;
       }
       case MUL: {
@@ -384,13 +929,13 @@ static void risc_single_step(struct RISC *risc) {
     // Branch instructions
     bool t = (ir >> 27) & 1;
     switch ((ir >> 24) & 7) {
-      case 0: t ^= risc->N; break;
-      case 1: t ^= risc->Z; break;
-      case 2: t ^= risc->C; break;
-      case 3: t ^= risc->V; break;
-      case 4: t ^= risc->C | risc->Z; break;
-      case 5: t ^= risc->N ^ risc->V; break;
-      case 6: t ^= (risc->N ^ risc->V) | risc->Z; break;
+      case 0: t ^= risc_flag_N(risc); break;
+      case 1: t ^= risc_flag_Z(risc); break;
+      case 2: t ^= risc_flag_C(risc); break;
+      case 3: t ^= risc_flag_V(risc); break;
+      case 4: t ^= risc_flag_C(risc) | risc_flag_Z(risc); break;
+      case 5: t ^= risc_flag_N(risc) ^ risc_flag_V(risc); break;
+      case 6: t ^= (risc_flag_N(risc) ^ risc_flag_V(risc)) | risc_flag_Z(risc); break;
       case 7: t ^= true; break;
       default: abort();  // unreachable
     }
@@ -412,11 +957,30 @@ static void risc_single_step(struct RISC *risc) {
 
 static void risc_set_register(struct RISC *risc, int reg, uint32_t value) {
   risc->R[reg] = value;
-  risc->Z = value == 0;
-  risc->N = (int32_t)value < 0;
+  risc->flag_value = value;
+}
+
+// Points the memory map at RAM. Only whole pages are mapped; stores
+// to the framebuffer are left out so they can record damage.
+void risc_map_memory(struct RISC *risc) {
+  for (uint32_t page = 0; page < risc->mem_size >> PageShift; page++) {
+    uint32_t *host = risc->RAM + (page << PageShift) / 4;
+    risc->load_map[page] = host;
+    risc->store_map[page] = (page + 1) << PageShift <= risc->display_start ? host : NULL;
+  }
 }
 
-static uint32_t risc_load_word(struct RISC *risc, uint32_t address) {
+// The fast paths are small enough to inline everywhere; anything not in
+// the memory map goes through the out-of-line *_unmapped versions.
+static inline uint32_t risc_load_word(struct RISC *risc, uint32_t address) {
+  const uint32_t *page = risc->load_map[address >> PageShift];
+  if (page) {
+    return page[address % PageSize / 4];
+  }
+  return risc_load_unmapped(risc, address);
+}
+
+static uint32_t risc_load_unmapped(struct RISC *risc, uint32_t address) {
   if (address < risc->mem_size) {
     return risc->RAM[address/4];
   } else {
@@ -424,42 +988,87 @@ static uint32_t risc_load_word(struct RISC *risc, uint32_t address) {
   }
 }
 
-static uint8_t risc_load_byte(struct RISC *risc, uint32_t address) {
+static inline uint8_t risc_load_byte(struct RISC *risc, uint32_t address) {
+#if RISC_LITTLE_ENDIAN
+  const uint32_t *page = risc->load_map[address >> PageShift];
+  if (page) {
+    return ((const uint8_t *)page)[address % PageSize];
+  }
+#endif
   uint32_t w = risc_load_word(risc, address);
   return (uint8_t)(w >> (address % 4 * 8));
 }
 
+static void risc_init_damage(struct RISC *risc) {
+  risc->tile_words = TileWidth / (risc->fb_color ? 8 : 32);
+  risc->tile_cols = (risc->fb_width + risc->tile_words - 1) / risc->tile_words;
+  risc->tile_rows = (risc->fb_height + TileHeight - 1) / TileHeight;
+  risc->tile_stride = (risc->tile_cols + 31) / 32;
+  free(risc->damage_map);
+  risc->damage_map = calloc(risc->tile_rows * risc->tile_stride, sizeof(uint32_t));
+  risc_damage_all(risc);
+}
+
+static void risc_damage_all(struct RISC *risc) {
+  for (int ty = 0; ty < risc->tile_rows; ty++) {
+    for (int tx = 0; tx < risc->tile_cols; tx++) {
+      risc->damage_map[ty * risc->tile_stride + tx / 32] |= 1u << (tx % 32);
+    }
+  }
+}
+
 static void risc_update_damage(struct RISC *risc, int w) {
   int row = w / risc->fb_width;
   int col = w % risc->fb_width;
   if (row < risc->fb_height) {
-    if (col < risc->damage.x1) {
-      risc->damage.x1 = col;
-    }
-    if (col > risc->damage.x2) {
-      risc->damage.x2 = col;
-    }
-    if (row < risc->damage.y1) {
-      risc->damage.y1 = row;
-    }
-    if (row > risc->damage.y2) {
-      risc->damage.y2 = row;
-    }
+    int tx = col / risc->tile_words;
+    int ty = row / TileHeight;
+    risc->damage_map[ty * risc->tile_stride + tx / 32] |= 1u << (tx % 32);
   }
 }
 
-static void risc_store_word(struct RISC *risc, uint32_t address, uint32_t value) {
+static inline void risc_store_word(struct RISC *risc, uint32_t address, uint32_t value) {
+  uint32_t *page = risc->store_map[address >> PageShift];
+  if (page) {
+    page[address % PageSize / 4] = value;
+    risc->RAM_decoded[address/4].kind = UNDECODED;
+  } else {
+    risc_store_unmapped(risc, address, value);
+  }
+}
+
+static void risc_store_unmapped(struct RISC *risc, uint32_t address, uint32_t value) {
   if (address < risc->display_start) {
     risc->RAM[address/4] = value;
+    risc->RAM_decoded[address/4].kind = UNDECODED;
+    if (risc->jit_code_map && risc->jit_code_map[address/4]) {
+      risc_jit_invalidate(risc->jit, address);
+    }
   } else if (address < risc->mem_size) {
     risc->RAM[address/4] = value;
+    risc->RAM_decoded[address/4].kind = UNDECODED;
+    if (risc->jit_code_map && risc->jit_code_map[address/4]) {
+      risc_jit_invalidate(risc->jit, address);
+    }
     risc_update_damage(risc, address/4 - risc->display_start/4);
   } else {
     risc_store_io(risc, address, value);
   }
 }
 
-static void risc_store_byte(struct RISC *risc, uint32_t address, uint8_t value) {
+static inline void risc_store_byte(struct RISC *risc, uint32_t address, uint8_t value) {
+#if RISC_LITTLE_ENDIAN
+  uint32_t *page = risc->store_map[address >> PageShift];
+  if (page) {
+    ((uint8_t *)page)[address % PageSize] = value;
+    risc->RAM_decoded[address/4].kind = UNDECODED;
+    return;
+  }
+#endif
+  risc_store_byte_unmapped(risc, address, value);
+}
+
+static void risc_store_byte_unmapped(struct RISC *risc, uint32_t address, uint8_t value) {
   if (address < risc->mem_size) {
     uint32_t w = risc_load_word(risc, address);
     uint32_t shift = (address & 3) * 8;
@@ -478,7 +1087,7 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
   switch (address - IOStart) {
     case 0: {
       // Millisecond counter
-      risc->progress--;
+      risc_poll(risc, true);
       return risc->current_tick;
     }
     case 4: {
@@ -487,6 +1096,7 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
     }
     case 8: {
       // RS232 data
+      risc_wake(risc);
       if (risc->serial) {
         return risc->serial->read_data(risc->serial);
       }
@@ -502,10 +1112,11 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
     case 16: {
       // SPI data
       const struct RISC_SPI *spi = risc->spi[risc->spi_selected];
+      risc_wake(risc);
       if (spi != NULL) {
         return spi->read_data(spi);
       }
-      return 255;
+      return risc->spi_fast ? 0xFFFFFFFF : 255;
     }
     case 20: {
       // SPI status
@@ -519,12 +1130,13 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
       if (risc->key_cnt > 0) {
         mouse |= 0x10000000;
       } else {
-        risc->progress--;
+        risc_poll(risc, false);
       }
       return mouse;
     }
     case 28: {
       // Keyboard input
+      risc_wake(risc);
       if (risc->key_cnt > 0) {
         uint8_t scancode = risc->key_buf[0];
         risc->key_cnt--;
@@ -533,6 +1145,10 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
       }
       return 0;
     }
+    case 36: {
+      // Disk DMA
+      return risc->disk_dma ? DiskDMAMagic : 0;
+    }
     case 40: {
       // Clipboard control
       if (risc->clipboard) {
@@ -555,13 +1171,10 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
 
 static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value) {
   if (risc->fb_color && address < IOStart && address >= PaletteStart) {
+    // The front ends notice the new generation and redraw with the
+    // new colours once per frame, however many entries changed.
     risc->Palette[(address - PaletteStart)/4] = value;
-    risc->damage = (struct Damage){
-      .x1 = 0,
-      .y1 = 0,
-      .x2 = risc->fb_width - 1,
-      .y2 = risc->fb_height - 1
-    };
+    risc->palette_generation++;
     return;
   }
   switch (address - IOStart) {
@@ -574,6 +1187,7 @@ static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value) {
     }
     case 8: {
       // RS232 data
+      risc_wake(risc);
       if (risc->serial) {
         risc->serial->write_data(risc->serial, value);
       }
@@ -582,24 +1196,39 @@ static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value) {
     case 16: {
       // SPI write
       const struct RISC_SPI *spi = risc->spi[risc->spi_selected];
+      risc_wake(risc);
       if (spi != NULL) {
-        spi->write_data(spi, value);
+        spi->write_data(spi, value, risc->spi_fast);
       }
       break;
     }
     case 20: {
       // SPI control
       // Bit 0-1: slave select
-      // Bit 2:   fast mode
+      // Bit 2:   fast mode (32-bit transfers instead of 8-bit)
       // Bit 3:   netwerk enable
       // Other bits unused
       risc->spi_selected = value & 3;
+      risc->spi_fast = (value & 4) != 0;
       break;
     }
     case 32: {
       // Host FS
       if (risc->hostfs) {
         risc->hostfs->write(risc->hostfs, value, risc->RAM);
+        // The host may have written anywhere in RAM, including code.
+        memset(risc->RAM_decoded, 0, risc->mem_size / 4 * sizeof(struct Decoded));
+        if (risc->jit) {
+          risc_jit_flush(risc->jit);
+        }
+      }
+      break;
+    }
+    case 36: {
+      // Disk DMA
+      if (risc->disk_dma) {
+        risc_wake(risc);
+        risc_disk_dma(risc, value);
       }
       break;
     }
@@ -620,12 +1249,101 @@ static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value) {
   }
 }
 
+// The guest stores the address of a command block
+//   op (0: read, 1: write), first block, block count, RAM address
+// and gets the op word back as 0 if the transfer was done, 1 if not.
+// Blocks are numbered as in the SD card's read and write commands, so
+// a transfer does the same as the SPI commands for each of its blocks,
+// without the guest having to move every word through the SPI port.
+static void risc_disk_dma(struct RISC *risc, uint32_t address) {
+  if (address % 4 != 0 || address >= risc->mem_size || risc->mem_size - address < 16) {
+    return;
+  }
+  uint32_t *cmd = &risc->RAM[address/4];
+  uint32_t op = cmd[0], block = cmd[1], count = cmd[2], ram = cmd[3];
+  bool ok = ram % 4 == 0 && ram < risc->mem_size &&
+            count <= (risc->mem_size - ram) / 512;
+  if (ok && op == 0) {
+    ok = risc->disk_dma->read(risc->disk_dma, block, count, &risc->RAM[ram/4]);
+    // Like any other store, except that there are many of them.
+    for (uint32_t w = ram/4; w < ram/4 + count * 128; w++) {
+      risc->RAM_decoded[w].kind = UNDECODED;
+      if (risc->jit_code_map && risc->jit_code_map[w]) {
+        risc_jit_invalidate(risc->jit, w * 4);
+      }
+      if (w >= risc->display_start/4) {
+        risc_update_damage(risc, (int)(w - risc->display_start/4));
+      }
+    }
+  } else if (ok && op == 1) {
+    ok = risc->disk_dma->write(risc->disk_dma, block, count, &risc->RAM[ram/4]);
+  } else {
+    ok = false;
+  }
+  risc_store_word(risc, address, ok ? 0 : 1);
+}
+
+// Called when the guest reads the millisecond counter or finds no key
+// waiting. An idle Oberon system does that from the same three places
+// (Input.Available, Input.Mouse and Kernel.Time) over and over, with no
+// other I/O in between. Only a poll from an instruction that has polled
+// before counts against progress, so code that merely reads the clock
+// now and then doesn't look idle.
+//
+// Once progress is used up, risc_run doesn't run anything until
+// risc_wake: on input, on I/O, or on a new time if the guest was
+// watching the clock. A guest tracking the mouse doesn't need to run
+// again just because a millisecond went by.
+static void risc_poll(struct RISC *risc, bool timer) {
+  risc->poll_timer |= timer;
+  for (int i = 0; i < risc->poll_sites; i++) {
+    if (risc->poll_pc[i] == risc->PC) {
+      risc->progress--;
+      return;
+    }
+  }
+  if (risc->poll_sites == PollSites) {
+    // Too many different places for a polling loop.
+    risc->poll_sites = 0;
+  }
+  risc->poll_pc[risc->poll_sites++] = risc->PC;
+}
+
+// Called on input and on disk, serial and keyboard data transfers,
+// which an idle loop doesn't do.
+static void risc_wake(struct RISC *risc) {
+  risc->progress = IdlePolls;
+  risc->poll_sites = 0;
+  risc->poll_timer = false;
+}
+
+
+uint32_t risc_mem_load_word(struct RISC *risc, uint32_t address) {
+  return risc_load_word(risc, address);
+}
+
+uint32_t risc_mem_load_byte(struct RISC *risc, uint32_t address) {
+  return risc_load_byte(risc, address);
+}
+
+void risc_mem_store_word(struct RISC *risc, uint32_t address, uint32_t value) {
+  risc_store_word(risc, address, value);
+}
+
+void risc_mem_store_byte(struct RISC *risc, uint32_t address, uint32_t value) {
+  risc_store_byte(risc, address, (uint8_t)value);
+}
+
 
 void risc_set_time(struct RISC *risc, uint32_t tick) {
+  if (risc->poll_timer && tick != risc->current_tick) {
+    risc_wake(risc);
+  }
   risc->current_tick = tick;
 }
 
 void risc_mouse_moved(struct RISC *risc, int mouse_x, int mouse_y) {
+  risc_wake(risc);
   if (mouse_x >= 0 && mouse_x < 4096) {
     risc->mouse = (risc->mouse & ~0x00000FFF) | mouse_x;
   }
@@ -635,6 +1353,7 @@ void risc_mouse_moved(struct RISC *risc, int mouse_x, int mouse_y) {
 }
 
 void risc_mouse_button(struct RISC *risc, int button, bool down) {
+  risc_wake(risc);
   if (button >= 1 && button < 4) {
     uint32_t bit = 1 << (27 - button);
     if (down) {
@@ -646,6 +1365,7 @@ void risc_mouse_button(struct RISC *risc, int button, bool down) {
 }
 
 void risc_keyboard_input(struct RISC *risc, uint8_t *scancodes, uint32_t len) {
+  risc_wake(risc);
   if (sizeof(risc->key_buf) - risc->key_cnt >= len) {
     memmove(&risc->key_buf[risc->key_cnt], scancodes, len);
     risc->key_cnt += len;
@@ -660,13 +1380,52 @@ uint32_t *risc_get_palette_ptr(struct RISC *risc) {
   return risc->Palette;
 }
 
-struct Damage risc_get_framebuffer_damage(struct RISC *risc) {
-  struct Damage dmg = risc->damage;
-  risc->damage = (struct Damage){
-    .x1 = risc->fb_width,
-    .x2 = 0,
-    .y1 = risc->fb_height,
-    .y2 = 0
-  };
-  return dmg;
+uint32_t risc_get_palette_generation(struct RISC *risc) {
+  return risc->palette_generation;
+}
+
+static bool risc_tile_dirty(struct RISC *risc, int tx, int ty) {
+  return (risc->damage_map[ty * risc->tile_stride + tx / 32] >> (tx % 32)) & 1;
+}
+
+bool risc_get_framebuffer_damage(struct RISC *risc, struct Damage *damage) {
+  for (int ty = 0; ty < risc->tile_rows; ty++) {
+    for (int tx = 0; tx < risc->tile_cols; tx++) {
+      if (!risc_tile_dirty(risc, tx, ty)) {
+        continue;
+      }
+      // Take the run of dirty tiles starting here, and the rows below
+      // that are dirty all along it.
+      int tx2 = tx;
+      while (tx2 + 1 < risc->tile_cols && risc_tile_dirty(risc, tx2 + 1, ty)) {
+        tx2++;
+      }
+      int ty2 = ty;
+      for (;;) {
+        bool whole = ty2 + 1 < risc->tile_rows;
+        for (int x = tx; whole && x <= tx2; x++) {
+          whole = risc_tile_dirty(risc, x, ty2 + 1);
+        }
+        if (!whole) {
+          break;
+        }
+        ty2++;
+      }
+      for (int y = ty; y <= ty2; y++) {
+        for (int x = tx; x <= tx2; x++) {
+          risc->damage_map[y * risc->tile_stride + x / 32] &= ~(1u << (x % 32));
+        }
+      }
+      int x2 = (tx2 + 1) * risc->tile_words;
+      int y2 = (ty2 + 1) * TileHeight;
+      *damage = (struct Damage){
+        .x1 = tx * risc->tile_words,
+        .x2 = (x2 < risc->fb_width ? x2 : risc->fb_width) - 1,
+        .y1 = ty * TileHeight,
+        .y2 = (y2 < risc->fb_height ? y2 : risc->fb_height) - 1
+      };
+      return true;
+    }
+  }
+  return false;
 }
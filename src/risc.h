@@ -11,6 +11,8 @@
 
 struct RISC;
 
+// A rectangle of the framebuffer, x in words and y in lines (line 0 is
+// the bottom of the screen), both inclusive.
 struct Damage {
   int x1, x2, y1, y2;
 };
@@ -23,9 +25,21 @@ void risc_set_spi(struct RISC *risc, int index, const struct RISC_SPI *spi);
 void risc_set_clipboard(struct RISC *risc, const struct RISC_Clipboard *clipboard);
 void risc_set_switches(struct RISC *risc, int switches);
 void risc_set_host_fs(struct RISC *risc, const struct RISC_HostFS *hostfs);
+void risc_set_disk_dma(struct RISC *risc, const struct RISC_DiskDMA *dma);
+bool risc_enable_jit(struct RISC *risc);
+// Samples the guest PC (and, with stacks, the call stack) every interval
+// instructions. risc_write_profile writes the samples collected so far
+// in collapsed stack format, one line per stack.
+void risc_enable_profiler(struct RISC *risc, int interval, bool stacks);
+bool risc_write_profile(struct RISC *risc, const char *filename);
 
 void risc_reset(struct RISC *risc);
-void risc_run(struct RISC *risc, int cycles);
+// Runs at most cycles instructions and returns how many ran, which is
+// fewer if the guest went idle.
+int risc_run(struct RISC *risc, int cycles);
+// True if the guest is sitting in a loop waiting for input or for the
+// millisecond counter to change. risc_run does nothing until it does.
+bool risc_is_idle(struct RISC *risc);
 void risc_set_time(struct RISC *risc, uint32_t tick);
 void risc_mouse_moved(struct RISC *risc, int mouse_x, int mouse_y);
 void risc_mouse_button(struct RISC *risc, int button, bool down);
@@ -33,6 +47,13 @@ void risc_keyboard_input(struct RISC *risc, uint8_t *scancodes, uint32_t len);
 
 uint32_t *risc_get_framebuffer_ptr(struct RISC *risc);
 uint32_t *risc_get_palette_ptr(struct RISC *risc);
-struct Damage risc_get_framebuffer_damage(struct RISC *risc);
+// Counts palette writes. They don't damage the framebuffer: when the
+// generation has changed, redraw everything with the new palette.
+uint32_t risc_get_palette_generation(struct RISC *risc);
+// Damage is kept per tile of 32x16 pixels. Each call returns one
+// rectangle of tiles written since they were last returned and marks
+// them clean; false means the framebuffer is clean. Call it until it
+// returns false to get all of the damage.
+bool risc_get_framebuffer_damage(struct RISC *risc, struct Damage *damage);
 
 #endif  // RISC_H
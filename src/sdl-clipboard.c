@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <SDL.h>
@@ -11,6 +12,55 @@ static char *data = NULL;
 static size_t data_ptr = 0;
 static size_t data_len = 0;
 
+// The guest runs on the emulation thread, but SDL's clipboard may only
+// be used from the main thread. So the main thread keeps a copy of the
+// host clipboard for the guest to read, and text from the guest waits
+// in outgoing until the main thread puts it on the host clipboard.
+static SDL_mutex *lock = NULL;
+static char *host_text = NULL;
+static char *outgoing = NULL;
+static Uint32 clipboard_event;
+
+static char *copy_text(const char *text) {
+  if (text == NULL) {
+    return NULL;
+  }
+  size_t len = strlen(text) + 1;
+  char *copy = malloc(len);
+  if (copy) {
+    memcpy(copy, text, len);
+  }
+  return copy;
+}
+
+void sdl_clipboard_init(void) {
+  lock = SDL_CreateMutex();
+  clipboard_event = SDL_RegisterEvents(1);
+}
+
+// Called on the main thread when the host clipboard has changed.
+void sdl_clipboard_update(void) {
+  char *text = SDL_GetClipboardText();
+  char *copy = copy_text(text);
+  SDL_free(text);
+  SDL_LockMutex(lock);
+  free(host_text);
+  host_text = copy;
+  SDL_UnlockMutex(lock);
+}
+
+// Called on the main thread to pass on text from the guest, if any.
+void sdl_clipboard_flush(void) {
+  SDL_LockMutex(lock);
+  char *text = outgoing;
+  outgoing = NULL;
+  SDL_UnlockMutex(lock);
+  if (text) {
+    SDL_SetClipboardText(text);
+    free(text);
+  }
+}
+
 static void reset() {
   state = IDLE;
   free(data);
@@ -22,7 +72,9 @@ static void reset() {
 static uint32_t clipboard_control_read(const struct RISC_Clipboard *clip) {
   uint32_t r = 0;
   reset();
-  data = SDL_GetClipboardText();
+  SDL_LockMutex(lock);
+  data = copy_text(host_text);
+  SDL_UnlockMutex(lock);
   if (data) {
     data_len = strlen(data);
     if (data_len > UINT32_MAX) {
@@ -83,8 +135,17 @@ static void clipboard_data_write(const struct RISC_Clipboard *clip, uint32_t c)
     ++data_ptr;
     if (data_ptr == data_len) {
       data[data_ptr] = 0;
-      SDL_SetClipboardText(data);
+      // Reading the clipboard back gives this text even before the
+      // main thread has passed it on.
+      SDL_LockMutex(lock);
+      free(host_text);
+      host_text = copy_text(data);
+      free(outgoing);
+      outgoing = data;
+      SDL_UnlockMutex(lock);
+      data = NULL;
       reset();
+      SDL_PushEvent(&(SDL_Event){ .type = clipboard_event });
     }
   }
 }
@@ -5,4 +5,8 @@
 
 extern const struct RISC_Clipboard sdl_clipboard;
 
+void sdl_clipboard_init(void);
+void sdl_clipboard_update(void);
+void sdl_clipboard_flush(void);
+
 #endif  // SDL_CLIPBOARD_H
@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sdl-frames.h"
+
+// Set in latest while the reader hasn't taken that frame.
+#define FRESH 4
+
+void frame_queue_init(struct FrameQueue *queue, int width, int height) {
+  memset(queue, 0, sizeof(*queue));
+  queue->width = width;
+  queue->height = height;
+  for (int i = 0; i < 3; i++) {
+    queue->frames[i].words = calloc((size_t)width * height, sizeof(uint32_t));
+  }
+  queue->back = 0;
+  SDL_AtomicSet(&queue->latest, 1);
+  queue->front = 2;
+}
+
+bool frame_queue_publish(struct FrameQueue *queue, const uint32_t *words,
+                         const uint32_t *palette, uint32_t palette_generation,
+                         const struct Damage *rects, int rect_count) {
+  struct Frame *frame = &queue->frames[queue->back];
+  bool whole = rect_count > MAX_FRAME_RECTS;
+  int count = 0;
+
+  // If the reader hasn't taken the previous frame, it will skip it and
+  // must get that frame's damage with this one. Should the reader take
+  // it after all while we look, it merely redraws a little more.
+  int latest = SDL_AtomicGet(&queue->latest);
+  if (latest & FRESH) {
+    const struct Frame *skipped = &queue->frames[latest & 3];
+    if (skipped->rect_count + rect_count > MAX_FRAME_RECTS) {
+      whole = true;
+    } else {
+      memcpy(frame->rects, skipped->rects, skipped->rect_count * sizeof(struct Damage));
+      count = skipped->rect_count;
+    }
+  }
+  if (whole) {
+    frame->rects[0] = (struct Damage){
+      .x1 = 0,
+      .x2 = queue->width - 1,
+      .y1 = 0,
+      .y2 = queue->height - 1
+    };
+    count = 1;
+  } else {
+    memcpy(frame->rects + count, rects, rect_count * sizeof(struct Damage));
+    count += rect_count;
+  }
+  frame->rect_count = count;
+  memcpy(frame->words, words, (size_t)queue->width * queue->height * sizeof(uint32_t));
+  memcpy(frame->palette, palette, sizeof(frame->palette));
+  frame->palette_generation = palette_generation;
+
+  // SDL_AtomicSet is only an acquire barrier on some compilers. Each
+  // swap hands one frame to the other side and takes one back, so the
+  // writes to it must be done before and the reads of the other after.
+  SDL_MemoryBarrierRelease();
+  latest = SDL_AtomicSet(&queue->latest, queue->back | FRESH);
+  SDL_MemoryBarrierAcquire();
+  queue->back = latest & 3;
+  return !(latest & FRESH);
+}
+
+struct Frame *frame_queue_take(struct FrameQueue *queue) {
+  if (!(SDL_AtomicGet(&queue->latest) & FRESH)) {
+    return NULL;
+  }
+  SDL_MemoryBarrierRelease();
+  queue->front = SDL_AtomicSet(&queue->latest, queue->front) & 3;
+  SDL_MemoryBarrierAcquire();
+  return &queue->frames[queue->front];
+}
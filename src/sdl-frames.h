@@ -0,0 +1,48 @@
+#ifndef SDL_FRAMES_H
+#define SDL_FRAMES_H
+
+#include <SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "risc.h"
+
+#define MAX_FRAME_RECTS 256
+
+// A copy of the framebuffer and palette, and the rectangles that changed
+// since the last frame the reader took. A new palette_generation means
+// the palette changed, which the rectangles don't cover.
+struct Frame {
+  uint32_t *words;
+  uint32_t palette[16];
+  uint32_t palette_generation;
+  int rect_count;
+  struct Damage rects[MAX_FRAME_RECTS];
+};
+
+// Passes frames from the emulation thread to one reader thread without
+// locking. Of the three frames, the writer fills one while the reader
+// draws another; the third is the latest finished frame and changes
+// hands with an atomic swap of its index.
+struct FrameQueue {
+  struct Frame frames[3];
+  int width, height;  // words per line, lines
+  int back;           // owned by the writer
+  int front;          // owned by the reader
+  SDL_atomic_t latest;
+};
+
+void frame_queue_init(struct FrameQueue *queue, int width, int height);
+
+// Copies the framebuffer into a new frame with the given damage; a
+// rect_count above MAX_FRAME_RECTS stands for the whole screen. Returns
+// true if the reader had taken the previous frame, i.e. it may need to
+// be told that there is a new one.
+bool frame_queue_publish(struct FrameQueue *queue, const uint32_t *words,
+                         const uint32_t *palette, uint32_t palette_generation,
+                         const struct Damage *rects, int rect_count);
+
+// Returns the latest frame if it hasn't been taken yet, otherwise NULL.
+// The frame stays valid until the next call.
+struct Frame *frame_queue_take(struct FrameQueue *queue);
+
+#endif  // SDL_FRAMES_H
@@ -12,15 +12,27 @@
 #include "risc.h"
 #include "risc-io.h"
 #include "disk.h"
+#include "fb-convert.h"
 #include "pclink.h"
 #include "raw-serial.h"
 #include "sdl-ps2.h"
 #include "sdl-clipboard.h"
+#include "sdl-frames.h"
 #include "rfb-ps2.h"
 
 #define CPU_HZ 25000000
 #define FPS 60
 
+// Frames come FPS times a second while there is input or the screen
+// changes, as often as the display refreshes for MOTION_MS after the
+// mouse moved, and IDLE_FPS times a second once there has been neither
+// input nor a change on screen for IDLE_MS. The guest itself runs in
+// slices of at most 1000 / FPS ms whatever the frame rate, so its clock
+// and its input don't slow down with the display.
+#define IDLE_FPS 10
+#define IDLE_MS 2000
+#define MOTION_MS 250
+
 static uint32_t BLACK = 0x657b83, WHITE = 0xfdf6e3;
 //static uint32_t BLACK = 0x000000, WHITE = 0xFFFFFF;
 //static uint32_t BLACK = 0x0000FF, WHITE = 0xFFFF00;
@@ -29,13 +41,61 @@ static uint32_t BLACK = 0x657b83, WHITE = 0xfdf6e3;
 #define MAX_HEIGHT 2048
 #define MAX_WIDTH  2048
 
+#define INPUT_QUEUE_LEN 256
+
+// What the threads share. Everything but quit is set up before they
+// start; the guest itself belongs to the emulation thread, which is
+// sent input through the input queue and sends frames back through
+// the frame queues.
+struct Session {
+  bool virtual_time;
+  bool color;
+  bool use_SDL;
+  const struct RISC_Serial *serial;
+  const struct RISC_SPI *disk;
+  rfbScreenInfoPtr screen;  // NULL without VNC
+};
+
+enum InputKind {
+  INPUT_MOUSE_MOVED,
+  INPUT_MOUSE_BUTTON,
+  INPUT_KEYBOARD,
+  INPUT_RESET
+};
+
+struct Input {
+  enum InputKind kind;
+  int x, y;  // position, or button in x
+  bool down;
+  uint8_t bytes[MAX_PS2_CODE_LEN];
+  int len;
+};
+
+static SDL_atomic_t quit;
+static SDL_atomic_t refresh_ms;  // how often the display refreshes, set by the main loop
+static struct FrameQueue sdl_frames, vnc_frames;
+static uint32_t vnc_palette_generation;  // of the colours in the VNC colour map
+static Uint32 frame_event;
+static struct Input input_queue[INPUT_QUEUE_LEN];
+static int input_head, input_count;
+static SDL_mutex *input_lock;
+static SDL_cond *input_ready;
+
 static int best_display(const SDL_Rect *rect);
 static int clamp(int x, int min, int max);
 static enum Action map_keyboard_event(SDL_KeyboardEvent *event);
 static void show_leds(const struct RISC_LED *leds, uint32_t value);
 static double scale_display(SDL_Window *window, const SDL_Rect *risc_rect, SDL_Rect *display_rect);
-static void update_texture(struct RISC *risc, SDL_Texture *texture, const SDL_Rect *risc_rect, bool color);
-static void update_rfb(struct RISC *risc, rfbScreenInfoPtr screen, bool color);
+static int refresh_interval(SDL_Window *window);
+static int frame_interval(uint32_t since_activity, uint32_t since_motion, int refresh_ms);
+static void update_texture(const struct Frame *frame, SDL_Texture *texture, const SDL_Rect *risc_rect, bool color);
+static void set_colour_map(rfbScreenInfoPtr screen, const uint32_t *palette, int count);
+static void update_rfb(const struct Frame *frame, rfbScreenInfoPtr screen, bool color);
+static void post_input(struct Input input);
+static void apply_input(const struct Session *session, uint32_t now, uint32_t *last_input, uint32_t *last_motion);
+static int run_emulation(void *data);
+static int serve_vnc(void *data);
+static void wait_for_input(uint32_t until, const struct RISC_Serial *serial);
 static void doptr(int buttonMask,int x,int y,rfbClientPtr cl);
 static void dokey(rfbBool down,rfbKeySym key,rfbClientPtr cl);
 
@@ -81,6 +141,14 @@ static struct option long_options[] = {
   { "hostfs",           required_argument, NULL, 'H' },
   { "vnc",              no_argument,       NULL, 'v' },
   { "headless",         no_argument,       NULL, 'h' },
+  { "jit",              no_argument,       NULL, 'J' },
+  { "virtual-time",     no_argument,       NULL, 'T' },
+  { "profile",          required_argument, NULL, 'P' },
+  { "profile-interval", required_argument, NULL, 'N' },
+  { "profile-stacks",   no_argument,       NULL, 'K' },
+  { "mmap-disk",        no_argument,       NULL, 'D' },
+  { "disk-sync",        required_argument, NULL, 'Y' },
+  { "disk-cache",       required_argument, NULL, 'C' },
   { NULL,               no_argument,       NULL, 0   }
 };
 
@@ -109,6 +177,20 @@ static void usage() {
        "  --hostfs DIRECTORY    Use DIRECTORY as HostFS directory\n"
        "  --vnc                 Set up VNC server for display access\n"
        "  --headless.           Disable display (impliess --vnc)\n"
+       "  --jit                 Translate RISC code to native code (x86-64 only)\n"
+       "  --virtual-time        Derive the millisecond timer from executed instructions\n"
+       "                        and run as fast as possible\n"
+       "  --profile FILE        Sample the guest PC and write a profile to FILE at exit\n"
+       "  --profile-interval N  Take a sample every N instructions (default 10000)\n"
+       "  --profile-stacks      Include call stacks in the profile\n"
+       "  --mmap-disk           Map the disk image into memory instead of using stdio\n"
+       "  --disk-cache SECTORS  Cache SECTORS disk sectors in memory and write changes\n"
+       "                        back in the background\n"
+       "  --disk-sync MS        With --mmap-disk or --disk-cache, flush changes to disk\n"
+       "                        every MS milliseconds (default: only at reset and exit)\n"
+       "\n"
+       "DISK-IMAGE may be BASE+OVERLAY to leave the image BASE unchanged and keep\n"
+       "written sectors in the file OVERLAY, which is created if needed.\n"
        );
   exit(1);
 }
@@ -116,10 +198,18 @@ static void usage() {
 /* make global as VNC keyboard and mouse handlers require it */
 static struct RISC *risc;
 static SDL_Rect risc_rect;
+static const char *profile_file;
+
+static void write_profile(void) {
+  if (!risc_write_profile(risc, profile_file)) {
+    fprintf(stderr, "Could not write profile to %s\n", profile_file);
+  }
+}
 
 int main (int argc, char *argv[]) {
+  const struct RISC_Serial *serial = &pclink;
   risc = risc_new();
-  risc_set_serial(risc, &pclink);
+  risc_set_serial(risc, serial);
   risc_set_clipboard(risc, &sdl_clipboard);
 
   rfbScreenInfoPtr rfbScreen = NULL;
@@ -141,9 +231,14 @@ int main (int argc, char *argv[]) {
   bool boot_from_serial = false;
   bool use_VNC = false;
   bool use_SDL = true;
+  bool jit_option = false;
+  bool virtual_time = false;
+  int profile_interval = 10000;
+  bool profile_stacks = false;
+  struct DiskOptions disk_options = { 0 };
   
   int opt;
-  while ((opt = getopt_long(argc, argv, "z:fLrm:s:I:O:ScHvh:", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "z:fLrm:s:I:O:ScHvh:JTP:N:KDY:C:", long_options, NULL)) != -1) {
     switch (opt) {
       case 'z': {
         double x = strtod(optarg, 0);
@@ -210,6 +305,44 @@ int main (int argc, char *argv[]) {
         use_SDL = false;
         break;
       }
+      case 'J': {
+        jit_option = true;
+        break;
+      }
+      case 'T': {
+        virtual_time = true;
+        break;
+      }
+      case 'P': {
+        profile_file = optarg;
+        break;
+      }
+      case 'N': {
+        if (sscanf(optarg, "%d", &profile_interval) != 1 || profile_interval < 1) {
+          usage();
+        }
+        break;
+      }
+      case 'K': {
+        profile_stacks = true;
+        break;
+      }
+      case 'D': {
+        disk_options.mmap = true;
+        break;
+      }
+      case 'Y': {
+        if (sscanf(optarg, "%d", &disk_options.sync_ms) != 1 || disk_options.sync_ms < 0) {
+          usage();
+        }
+        break;
+      }
+      case 'C': {
+        if (sscanf(optarg, "%d", &disk_options.cache_sectors) != 1 || disk_options.cache_sectors < 1) {
+          usage();
+        }
+        break;
+      }
       default: {
         usage();
       }
@@ -219,12 +352,23 @@ int main (int argc, char *argv[]) {
   if (mem_option || size_option || rtc_option || color_option) {
     risc_configure_memory(risc, mem_option, rtc_option, risc_rect.w, risc_rect.h, color_option);
   }
+  if (jit_option) {
+    risc_enable_jit(risc);
+  }
+  if (profile_file) {
+    risc_enable_profiler(risc, profile_interval, profile_stacks);
+    atexit(write_profile);
+  }
 
+  struct RISC_SPI *disk;
   if (optind == argc - 1) {
-    risc_set_spi(risc, 1, disk_new(argv[optind]));
+    disk = disk_new(argv[optind], &disk_options);
+    risc_set_spi(risc, 1, disk);
+    risc_set_disk_dma(risc, disk_get_dma(disk));
   } else if (optind == argc && boot_from_serial) {
     /* Allow diskless boot */
-    risc_set_spi(risc, 1, disk_new(NULL));
+    disk = disk_new(NULL, NULL);
+    risc_set_spi(risc, 1, disk);
   } else {
     usage();
   }
@@ -236,7 +380,8 @@ int main (int argc, char *argv[]) {
     if (!serial_out) {
       serial_out = "/dev/null";
     }
-    risc_set_serial(risc, raw_serial_new(serial_in, serial_out));
+    serial = raw_serial_new(serial_in, serial_out);
+    risc_set_serial(risc, serial);
   }
 
   /* Define and set these to NULL here even if not used */
@@ -294,39 +439,79 @@ int main (int argc, char *argv[]) {
       fail(1, "Could not create texture: %s", SDL_GetError());
     }
 
-    
+    frame_event = SDL_RegisterEvents(1);
+    frame_queue_init(&sdl_frames, risc_rect.w / (color_option ? 8 : 32), risc_rect.h);
     display_scale = scale_display(window, &risc_rect, &display_rect);
-    update_texture(risc, texture, &risc_rect, color_option);
     SDL_ShowWindow(window);
     SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, &risc_rect, &display_rect);
     SDL_RenderPresent(renderer);
   }
   
   if (use_VNC) {
    
-    rfbScreen = rfbGetScreen(&argc,argv,risc_rect.w,risc_rect.h,8,3,4);
+    // The server framebuffer holds the guest's pixel values, one byte
+    // each, and a colour map turns them into colours. Clients that take
+    // this format get a quarter of the data of a true colour one, and
+    // the rest are translated for by the library.
+    rfbScreen = rfbGetScreen(&argc,argv,risc_rect.w,risc_rect.h,8,1,1);
     
     if(!rfbScreen)
       fail(1, "Could not create VNC server");
     
     rfbScreen->desktopName = "Oberon RISC Emulator";
-    rfbScreen->frameBuffer = (char*)malloc(risc_rect.w*risc_rect.h*4);
+    rfbScreen->frameBuffer = (char*)calloc(risc_rect.w, risc_rect.h);
+    rfbScreen->serverFormat.trueColour = FALSE;
+    rfbScreen->colourMap.count = 256;
+    rfbScreen->colourMap.is16 = FALSE;
+    rfbScreen->colourMap.data.bytes = calloc(256, 3);
+    if (color_option) {
+      set_colour_map(rfbScreen, risc_get_palette_ptr(risc), 16);
+    } else {
+      set_colour_map(rfbScreen, (uint32_t[]){ BLACK, WHITE }, 2);
+    }
     rfbScreen->alwaysShared = TRUE;
     rfbScreen->ptrAddEvent = doptr;
     rfbScreen->kbdAddEvent = dokey;
     rfbScreen->handleEventsEagerly = TRUE; // need this for good mouse cursor performance 
     /* initialize the server */
     rfbInitServer(rfbScreen);
+    frame_queue_init(&vnc_frames, risc_rect.w / (color_option ? 8 : 32), risc_rect.h);
+  }
+
+  // The emulation runs on a thread of its own and hands finished frames
+  // to this thread for SDL and to another one serving VNC, so neither a
+  // slow present nor a stalled VNC client holds up the guest.
+  input_lock = SDL_CreateMutex();
+  input_ready = SDL_CreateCond();
+  sdl_clipboard_init();
+  if (use_SDL) {
+    sdl_clipboard_update();
+  }
+  struct Session session = {
+    .virtual_time = virtual_time,
+    .color = color_option,
+    .serial = serial,
+    .disk = disk,
+    .use_SDL = use_SDL,
+    .screen = rfbScreen
+  };
+  SDL_AtomicSet(&refresh_ms, use_SDL ? refresh_interval(window) : 1000 / FPS);
+  SDL_Thread *emulation_thread = SDL_CreateThread(run_emulation, "emulation", &session);
+  SDL_Thread *vnc_thread = NULL;
+  if (use_VNC) {
+    vnc_thread = SDL_CreateThread(serve_vnc, "vnc", &session);
   }
 
-  bool done = false;
+  bool done = !use_SDL;
   bool mouse_was_offscreen = false;
   while (!done) {
-    uint32_t frame_start = SDL_GetTicks();
-
+    // The emulation thread sends frame_event when there is a new frame,
+    // which is only when something changed. Check for one every so often
+    // anyway, in case the event got lost.
     SDL_Event event;
-    while (SDL_PollEvent(&event)) {
+    bool redraw = false;
+    int have_event = SDL_WaitEventTimeout(&event, 1000 / IDLE_FPS);
+    while (have_event) {
       switch (event.type) {
         case SDL_QUIT: {
           done = true;
@@ -334,9 +519,17 @@ int main (int argc, char *argv[]) {
         }
 
         case SDL_WINDOWEVENT: {
-          if (use_SDL && (event.window.event == SDL_WINDOWEVENT_RESIZED)) {
+          if (event.window.event == SDL_WINDOWEVENT_RESIZED) {
             display_scale = scale_display(window, &risc_rect, &display_rect);
           }
+          // The window may have been uncovered or moved to another display.
+          SDL_AtomicSet(&refresh_ms, refresh_interval(window));
+          redraw = true;
+          break;
+        }
+
+        case SDL_CLIPBOARDUPDATE: {
+          sdl_clipboard_update();
           break;
         }
 
@@ -360,30 +553,23 @@ int main (int argc, char *argv[]) {
         }
 
         case SDL_MOUSEMOTION: {
-          int scaled_x, scaled_y;
-          if (use_SDL) {
-            scaled_x = (int)round((event.motion.x - display_rect.x) / display_scale);
-            scaled_y = (int)round((event.motion.y - display_rect.y) / display_scale);
-          } else {
-            scaled_x = event.motion.x;
-            scaled_y = event.motion.y;
-          }
+          int scaled_x = (int)round((event.motion.x - display_rect.x) / display_scale);
+          int scaled_y = (int)round((event.motion.y - display_rect.y) / display_scale);
           int x = clamp(scaled_x, 0, risc_rect.w - 1);
           int y = clamp(scaled_y, 0, risc_rect.h - 1);
           bool mouse_is_offscreen = x != scaled_x || y != scaled_y;
           if (mouse_is_offscreen != mouse_was_offscreen) {
-            if (use_SDL)
-              SDL_ShowCursor(mouse_is_offscreen);
+            SDL_ShowCursor(mouse_is_offscreen);
             mouse_was_offscreen = mouse_is_offscreen;
           }
-          risc_mouse_moved(risc, x, risc_rect.h - y - 1);
+          post_input((struct Input){ .kind = INPUT_MOUSE_MOVED, .x = x, .y = risc_rect.h - y - 1 });
           break;
         }
 
         case SDL_MOUSEBUTTONDOWN:
         case SDL_MOUSEBUTTONUP: {
           bool down = event.button.state == SDL_PRESSED;
-          risc_mouse_button(risc, event.button.button, down);
+          post_input((struct Input){ .kind = INPUT_MOUSE_BUTTON, .x = event.button.button, .down = down });
           break;
         }
 
@@ -392,11 +578,10 @@ int main (int argc, char *argv[]) {
           bool down = event.key.state == SDL_PRESSED;
           switch (map_keyboard_event(&event.key)) {
             case ACTION_RESET: {
-              risc_reset(risc);
+              post_input((struct Input){ .kind = INPUT_RESET });
               break;
             }
             case ACTION_TOGGLE_FULLSCREEN: {
-              if (!use_SDL) break;
               fullscreen ^= true;
               if (fullscreen) {
                 SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
@@ -410,58 +595,219 @@ int main (int argc, char *argv[]) {
               break;
             }
             case ACTION_FAKE_MOUSE1: {
-              risc_mouse_button(risc, 1, down);
+              post_input((struct Input){ .kind = INPUT_MOUSE_BUTTON, .x = 1, .down = down });
               break;
             }
             case ACTION_FAKE_MOUSE2: {
-              risc_mouse_button(risc, 2, down);
+              post_input((struct Input){ .kind = INPUT_MOUSE_BUTTON, .x = 2, .down = down });
               break;
             }
             case ACTION_FAKE_MOUSE3: {
-              risc_mouse_button(risc, 3, down);
+              post_input((struct Input){ .kind = INPUT_MOUSE_BUTTON, .x = 3, .down = down });
               break;
             }
             case ACTION_OBERON_INPUT: {
-              uint8_t ps2_bytes[MAX_PS2_CODE_LEN];
-              int len = ps2_encode(event.key.keysym.scancode, down, ps2_bytes);
-              risc_keyboard_input(risc, ps2_bytes, len);
+              struct Input input = { .kind = INPUT_KEYBOARD };
+              input.len = ps2_encode(event.key.keysym.scancode, down, input.bytes);
+              post_input(input);
               break;
             }
           }
         }
       }
+      have_event = SDL_PollEvent(&event);
     }
-    
-    risc_set_time(risc, frame_start);
-    risc_run(risc, CPU_HZ / FPS);
-    
-    if (use_SDL) {
-      update_texture(risc, texture, &risc_rect, color_option);
+    sdl_clipboard_flush();
+
+    struct Frame *frame = frame_queue_take(&sdl_frames);
+    if (frame) {
+      update_texture(frame, texture, &risc_rect, color_option);
+      redraw = true;
+    }
+    if (redraw) {
       SDL_RenderClear(renderer);
       SDL_RenderCopy(renderer, texture, &risc_rect, &display_rect);
       SDL_RenderPresent(renderer);
     }
+  }
+
+  if (vnc_thread && !use_SDL) {
+    SDL_WaitThread(vnc_thread, NULL);
+    vnc_thread = NULL;
+  }
+  SDL_AtomicSet(&quit, 1);
+  SDL_LockMutex(input_lock);
+  SDL_CondSignal(input_ready);
+  SDL_UnlockMutex(input_lock);
+  SDL_WaitThread(emulation_thread, NULL);
+  disk_free(disk);
+  if (vnc_thread) {
+    SDL_WaitThread(vnc_thread, NULL);
+  }
+  return 0;
+}
+
+static void post_input(struct Input input) {
+  SDL_LockMutex(input_lock);
+  if (input_count < INPUT_QUEUE_LEN) {
+    input_queue[(input_head + input_count) % INPUT_QUEUE_LEN] = input;
+    input_count++;
+  }
+  SDL_CondSignal(input_ready);
+  SDL_UnlockMutex(input_lock);
+}
+
+static void apply_input(const struct Session *session, uint32_t now, uint32_t *last_input, uint32_t *last_motion) {
+  struct Input inputs[INPUT_QUEUE_LEN];
+  SDL_LockMutex(input_lock);
+  int count = input_count;
+  for (int i = 0; i < count; i++) {
+    inputs[i] = input_queue[(input_head + i) % INPUT_QUEUE_LEN];
+  }
+  input_head = (input_head + count) % INPUT_QUEUE_LEN;
+  input_count = 0;
+  SDL_UnlockMutex(input_lock);
+
+  if (count > 0) {
+    *last_input = now;
+  }
+  for (int i = 0; i < count; i++) {
+    struct Input *input = &inputs[i];
+    switch (input->kind) {
+      case INPUT_MOUSE_MOVED: {
+        risc_mouse_moved(risc, input->x, input->y);
+        *last_motion = now;
+        break;
+      }
+      case INPUT_MOUSE_BUTTON: {
+        risc_mouse_button(risc, input->x, input->down);
+        break;
+      }
+      case INPUT_KEYBOARD: {
+        risc_keyboard_input(risc, input->bytes, input->len);
+        break;
+      }
+      case INPUT_RESET: {
+        // Whatever the guest does after the reset, what it wrote so
+        // far is safe on disk.
+        disk_sync(session->disk);
+        risc_reset(risc);
+        break;
+      }
+    }
+  }
+}
+
+// Returns whether anything changed on screen.
+static bool publish_frame(const struct Session *session) {
+  struct Damage rects[MAX_FRAME_RECTS];
+  struct Damage damage;
+  int count = 0;
+  while (risc_get_framebuffer_damage(risc, &damage)) {
+    if (count < MAX_FRAME_RECTS) {
+      rects[count] = damage;
+    }
+    count++;
+  }
+  static uint32_t published_generation;
+  uint32_t generation = risc_get_palette_generation(risc);
+  if (count == 0 && generation == published_generation) {
+    return false;
+  }
+  published_generation = generation;
+  uint32_t *words = risc_get_framebuffer_ptr(risc);
+  uint32_t *palette = risc_get_palette_ptr(risc);
+  if (session->use_SDL && frame_queue_publish(&sdl_frames, words, palette, generation, rects, count)) {
+    SDL_PushEvent(&(SDL_Event){ .type = frame_event });
+  }
+  if (session->screen) {
+    frame_queue_publish(&vnc_frames, words, palette, generation, rects, count);
+  }
+  return true;
+}
+
+static int run_emulation(void *data) {
+  const struct Session *session = data;
+  uint32_t virtual_ms = 0;
+  uint32_t last_input = SDL_GetTicks();
+  uint32_t last_motion = last_input - MOTION_MS;
+  uint32_t last_damage = last_input;
+  uint32_t last_publish = last_input - 1000 / IDLE_FPS;
+  while (!SDL_AtomicGet(&quit)) {
+    uint32_t frame_start = SDL_GetTicks();
+    apply_input(session, frame_start, &last_input, &last_motion);
+    // A guest that keeps drawing isn't idle, input or not.
+    uint32_t last_activity = (int)(last_damage - last_input) > 0 ? last_damage : last_input;
+    int interval = frame_interval(frame_start - last_activity, frame_start - last_motion,
+                                  SDL_AtomicGet(&refresh_ms));
+    int length = interval < 1000 / FPS ? interval : 1000 / FPS;
 
-    if (use_VNC) {
-      update_rfb(risc, rfbScreen, color_option);
-      rfbProcessEvents(rfbScreen,-1);
-      if (!rfbIsActive(rfbScreen))
-        done = true;
-    }    
+    if (session->virtual_time) {
+      // Guest time advances by one millisecond per CPU_HZ / 1000
+      // instructions. When risc_run returns early because the guest is
+      // idle, the rest of that millisecond is skipped. Keep going until a
+      // slice's worth of host time has passed, then handle input and
+      // update the display as usual.
+      do {
+        risc_set_time(risc, virtual_ms++);
+        risc_run(risc, CPU_HZ / 1000);
+      } while (SDL_GetTicks() - frame_start < (uint32_t)length);
+    } else {
+      risc_set_time(risc, frame_start);
+      risc_run(risc, CPU_HZ / 1000 * length);
+    }
+    if (frame_start - last_publish >= (uint32_t)interval) {
+      last_publish = frame_start;
+      if (publish_frame(session)) {
+        last_damage = SDL_GetTicks();
+      }
+    }
 
     uint32_t frame_end = SDL_GetTicks();
-    int delay = frame_start + 1000/FPS - frame_end;
+    int delay = frame_start + length - frame_end;
     if (delay > 0) {
-      SDL_Delay(delay);
+      if (risc_is_idle(risc)) {
+        wait_for_input(frame_start + length, session->serial);
+      } else {
+        SDL_Delay(delay);
+      }
+    }
+  }
+  return 0;
+}
+
+static int serve_vnc(void *data) {
+  const struct Session *session = data;
+  rfbScreenInfoPtr screen = session->screen;
+  while (!SDL_AtomicGet(&quit) && rfbIsActive(screen)) {
+    struct Frame *frame = frame_queue_take(&vnc_frames);
+    if (frame) {
+      update_rfb(frame, screen, session->color);
     }
-#if 0
-    if (delay < 10)
-       printf("%x - %x: Ticks spent: %d Delay: %d\n", frame_start, frame_end, frame_end-frame_start, delay);
-#endif
+    rfbProcessEvents(screen, 1000000 / FPS);
+  }
+  if (session->use_SDL) {
+    SDL_PushEvent(&(SDL_Event){ .type=SDL_QUIT });
   }
   return 0;
 }
 
+// Sleeps until the given tick, returning early as soon as there is
+// input for the guest or serial data arrives. Waits at most 1 ms at a
+// time so serial input is never left waiting longer than that.
+static void wait_for_input(uint32_t until, const struct RISC_Serial *serial) {
+  // A serial input that is always readable (at end of file, say) must
+  // not stop us from sleeping; only wake up when it becomes readable.
+  bool serial_ready = serial && (serial->read_status(serial) & 1);
+  SDL_LockMutex(input_lock);
+  while (input_count == 0 && !SDL_AtomicGet(&quit) && (int)(until - SDL_GetTicks()) > 0) {
+    if (serial && !serial_ready && (serial->read_status(serial) & 1)) {
+      break;
+    }
+    SDL_CondWaitTimeout(input_ready, input_lock, 1);
+  }
+  SDL_UnlockMutex(input_lock);
+}
 
 static int best_display(const SDL_Rect *rect) {
   int best = 0;
@@ -485,6 +831,25 @@ static int clamp(int x, int min, int max) {
   return x;
 }
 
+static int refresh_interval(SDL_Window *window) {
+  SDL_DisplayMode mode;
+  int display = SDL_GetWindowDisplayIndex(window);
+  if (display < 0 || SDL_GetCurrentDisplayMode(display, &mode) != 0 || mode.refresh_rate <= 0) {
+    return 1000 / FPS;
+  }
+  return clamp(1000 / mode.refresh_rate, 1, 1000 / FPS);
+}
+
+static int frame_interval(uint32_t since_activity, uint32_t since_motion, int refresh_ms) {
+  if (since_motion < MOTION_MS) {
+    return refresh_ms;
+  }
+  if (since_activity < IDLE_MS) {
+    return 1000 / FPS;
+  }
+  return 1000 / IDLE_FPS;
+}
+
 static enum Action map_keyboard_event(SDL_KeyboardEvent *event) {
   for (size_t i = 0; i < sizeof(key_map) / sizeof(key_map[0]); i++) {
     if ((event->state == key_map[i].state) &&
@@ -532,36 +897,38 @@ static double scale_display(SDL_Window *window, const SDL_Rect *risc_rect, SDL_R
   return scale;
 }
 
-// Only used in update_texture(), but some systems complain if you
-// allocate three megabyte on the stack.
-static uint32_t pixel_buf[MAX_WIDTH * MAX_HEIGHT];
-
-static void update_texture(struct RISC *risc, SDL_Texture *texture, const SDL_Rect *risc_rect, bool color) {
-  struct Damage damage = risc_get_framebuffer_damage(risc);
-  if (damage.y1 <= damage.y2) {
-    uint32_t *in = risc_get_framebuffer_ptr(risc);
-    uint32_t *pal = color ? risc_get_palette_ptr(risc) : NULL;
-    uint32_t out_idx = 0;
-
-    for (int line = damage.y2; line >= damage.y1; line--) {
-      int line_start = line * (risc_rect->w / (color ? 8 : 32));
-      for (int col = damage.x1; col <= damage.x2; col++) {
-        uint32_t pixels = in[line_start + col];
-        if (color) {
-          for (int b = 0; b < 8; b++) {
-            pixel_buf[out_idx] = pal[pixels & 0xF];
-            pixels >>= 4;
-            out_idx++;
-          }
-        } else {
-          for (int b = 0; b < 32; b++) {
-            pixel_buf[out_idx] = (pixels & 1) ? WHITE : BLACK;
-            pixels >>= 1;
-            out_idx++;
-          }
-        }
-      }
+// Expands each damaged rectangle straight into the locked texture. What
+// SDL_LockTexture hands out need not hold the old contents, but every
+// pixel of the rectangle is written. A new palette only takes a new
+// table and another pass over the frame.
+static void update_texture(const struct Frame *frame, SDL_Texture *texture, const SDL_Rect *risc_rect, bool color) {
+  static struct FB_Table table;
+  static uint32_t table_generation;
+  static bool have_table;
+  const struct Damage *rects = frame->rects;
+  int rect_count = frame->rect_count;
+  struct Damage whole = {
+    .x1 = 0,
+    .x2 = risc_rect->w / (color ? 8 : 32) - 1,
+    .y1 = 0,
+    .y2 = risc_rect->h - 1
+  };
+  if (!have_table || (color && frame->palette_generation != table_generation)) {
+    if (color) {
+      fb_build_table(&table, frame->palette, 16);
+    } else {
+      fb_build_table(&table, (const uint32_t[]){ BLACK, WHITE }, 2);
     }
+    table_generation = frame->palette_generation;
+    have_table = true;
+    rects = &whole;
+    rect_count = 1;
+  }
+
+  for (int i = 0; i < rect_count; i++) {
+    struct Damage damage = rects[i];
+    const uint32_t *in = frame->words;
+    int words = damage.x2 - damage.x1 + 1;
 
     SDL_Rect rect = {
       .x = damage.x1 * (color ? 8 : 32),
@@ -569,53 +936,79 @@ static void update_texture(struct RISC *risc, SDL_Texture *texture, const SDL_Re
       .w = (damage.x2 - damage.x1 + 1) * (color ? 8 : 32),
       .h = (damage.y2 - damage.y1 + 1)
     };
-    SDL_UpdateTexture(texture, &rect, pixel_buf, rect.w * 4);
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(texture, &rect, &pixels, &pitch) != 0) {
+      continue;
+    }
+    char *out = pixels;
+    for (int line = damage.y2; line >= damage.y1; line--) {
+      int line_start = line * (risc_rect->w / (color ? 8 : 32));
+      if (color) {
+        fb_color_to_argb((uint32_t *)out, &in[line_start + damage.x1], words, &table);
+      } else {
+        fb_mono_to_argb((uint32_t *)out, &in[line_start + damage.x1], words, &table);
+      }
+      out += pitch;
+    }
+    SDL_UnlockTexture(texture);
   }
 }
 
-static void update_rfb(struct RISC *risc, rfbScreenInfoPtr screen, bool color) {
-  struct Damage damage = risc_get_framebuffer_damage(risc);
-  
-  if (damage.y1 <= damage.y2) {
-    uint32_t *in = risc_get_framebuffer_ptr(risc);
-    uint32_t *pal = color ? risc_get_palette_ptr(risc) : NULL;
+static void set_colour_map(rfbScreenInfoPtr screen, const uint32_t *palette, int count) {
+  uint8_t *rgb = screen->colourMap.data.bytes;
+  for (int i = 0; i < count; i++) {
+    rgb[i*3 + 0] = (uint8_t)(palette[i] >> 16);
+    rgb[i*3 + 1] = (uint8_t)(palette[i] >> 8);
+    rgb[i*3 + 2] = (uint8_t)palette[i];
+  }
+}
 
-   int rowstride = screen->paddedWidthInBytes;
-   int bpp = screen->serverFormat.bitsPerPixel/8;
+// Expands the damaged rectangles straight into the server's framebuffer,
+// a row at a time, and marks them modified in one go.
+static void update_rfb(const struct Frame *frame, rfbScreenInfoPtr screen, bool color) {
+  const uint32_t *in = frame->words;
+  int rowstride = screen->paddedWidthInBytes;
+  int words_per_line = risc_rect.w / (color ? 8 : 32);
+  int pixels_per_word = color ? 8 : 32;
 
-   int fbx1 = damage.x1 * (color ? 8 : 32);
-   int fbx2 = damage.x2 * (color ? 8 : 32) + (color ? 8 : 32);
-   int fby1 = risc_rect.h - damage.y1;
-   int fby2 = risc_rect.h - damage.y2 - 1;
-   
-   for (int line = damage.y2; line >= damage.y1; line--) {
-     int line_start = line * (risc_rect.w / (color ? 8 : 32));
-     for (int col = damage.x1; col <= damage.x2; col++) {
-       uint32_t pixels = in[line_start + col];
-       if (color) {
-         for (int b = 0; b < 8; b++) {
-           rfbDrawPixel(screen, col*8+b, line , pal[pixels & 0xF]);
-           pixels >>= 4;
-         }
-       } else {
-         for (int b = 0; b < 32; b++) {
-           uint32_t colorbuf = (pixels & 0x1) ? Swap24(WHITE) : Swap24(BLACK);
-           memcpy(screen->frameBuffer+(risc_rect.h - line - 1)*rowstride+(col*32+b)*bpp,&colorbuf,bpp);
-           pixels >>= 1;
-         }
-       }
-     }
-   }
-   rfbMarkRectAsModified(screen, fbx1, fby1, fbx2, fby2);
+  // The pixels stay the same when only the palette changes.
+  if (color && frame->palette_generation != vnc_palette_generation) {
+    set_colour_map(screen, frame->palette, 16);
+    rfbSetClientColourMaps(screen, 0, 16);
+    vnc_palette_generation = frame->palette_generation;
+  }
+
+  sraRegionPtr modified = sraRgnCreate();
+  for (int i = 0; i < frame->rect_count; i++) {
+    struct Damage damage = frame->rects[i];
+    int words = damage.x2 - damage.x1 + 1;
+    int x = damage.x1 * pixels_per_word;
+
+    for (int line = damage.y2; line >= damage.y1; line--) {
+      const uint32_t *src = &in[line * words_per_line + damage.x1];
+      uint8_t *out = (uint8_t *)screen->frameBuffer + (risc_rect.h - line - 1) * rowstride + x;
+      if (color) {
+        fb_color_to_index8(out, src, words);
+      } else {
+        fb_mono_to_index8(out, src, words);
+      }
+    }
 
-  }  
+    sraRegionPtr rect = sraRgnCreateRect(x, risc_rect.h - damage.y2 - 1,
+                                         x + words * pixels_per_word, risc_rect.h - damage.y1);
+    sraRgnOr(modified, rect);
+    sraRgnDestroy(rect);
+  }
+  rfbMarkRegionAsModified(screen, modified);
+  sraRgnDestroy(modified);
 }
 
 
 static void doptr(int buttonMask,int x,int y,rfbClientPtr cl)
 {
    if(x>=0 && y>=0 && x<risc_rect.w && y<risc_rect.h) {
-      risc_mouse_moved(risc, x, risc_rect.h - y - 1);
+      post_input((struct Input){ .kind = INPUT_MOUSE_MOVED, .x = x, .y = risc_rect.h - y - 1 });
    }
 }
 
@@ -650,19 +1043,19 @@ static void dokey(rfbBool down,rfbKeySym key,rfbClientPtr cl)
   printf("char: %c key: 0x%x  down: 0x%x\n", key, key, down);
   /* Fake Mouse buttons & other controls */
   if(Control_down && (key==XK_semicolon))
-    risc_mouse_button(risc, 1, down);
+    post_input((struct Input){ .kind = INPUT_MOUSE_BUTTON, .x = 1, .down = down });
   else if(Control_down && (key==XK_q))
-    risc_mouse_button(risc, 2, down);
+    post_input((struct Input){ .kind = INPUT_MOUSE_BUTTON, .x = 2, .down = down });
   else if(Control_down && (key==XK_j))
-    risc_mouse_button(risc, 3, down);
+    post_input((struct Input){ .kind = INPUT_MOUSE_BUTTON, .x = 3, .down = down });
   else if(Control_down && (key==XK_x))
     rfbShutdownServer(cl->screen,TRUE);
   else {
-    uint8_t ps2_bytes[MAX_PS2_CODE_LEN];
-    int len = rfb_ps2_encode(key, down, ps2_bytes);
-    //for (int i = 0; i < len; i++) 
-    //  printf("--> 0x%x, ", ps2_bytes[i]);
+    struct Input input = { .kind = INPUT_KEYBOARD };
+    input.len = rfb_ps2_encode(key, down, input.bytes);
+    //for (int i = 0; i < input.len; i++) 
+    //  printf("--> 0x%x, ", input.bytes[i]);
     //printf("<--\n");
-    risc_keyboard_input(risc, ps2_bytes, len);
+    post_input(input);
   }
 }